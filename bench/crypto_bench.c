@@ -0,0 +1,222 @@
+// Micro-benchmarks for the crypto/integrity primitives in src/crypto.c.
+// Build with `make bench`, run with `./bin/crypto_bench`.
+
+#include "crypto.h"
+#include "hash.h"
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double NowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void BenchCRC(const char *name, bool castagnoli,
+                     const unsigned char *buf, size_t len, int iterations) {
+  volatile uint32_t sink = 0;
+  double start = NowSeconds();
+  for (int i = 0; i < iterations; i++)
+    sink ^= castagnoli ? Crypto_CRC32C(buf, len) : Crypto_CRC32(buf, len);
+  double elapsed = NowSeconds() - start;
+  (void)sink;
+
+  double mb = (double)len * iterations / (1024.0 * 1024.0);
+  printf("%-8s %-10s %8zu bytes  %9.1f MB/s\n", name,
+         Crypto_CRCBackend(castagnoli), len, mb / elapsed);
+}
+
+static void BenchHash(const unsigned char *buf, size_t len, int iterations) {
+  unsigned char digest[HASH_LEN];
+  double start = NowSeconds();
+  for (int i = 0; i < iterations; i++)
+    Hash_Buffer(buf, len, digest);
+  double elapsed = NowSeconds() - start;
+
+  double mb = (double)len * iterations / (1024.0 * 1024.0);
+  printf("%-8s %-10s %8zu bytes  %9.1f MB/s\n", "hash", Hash_Name(), len,
+         mb / elapsed);
+}
+
+// Baseline: what every message used to pay, a fresh context and key setup
+static unsigned char *EncryptUncached(const unsigned char *plaintext, int len,
+                                      const unsigned char *key, int *outLen) {
+  unsigned char iv[16];
+  RAND_bytes(iv, sizeof(iv));
+  unsigned char *out = malloc(len + 32);
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  int n1 = 0, n2 = 0;
+  memcpy(out, iv, 16);
+  EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
+  EVP_EncryptUpdate(ctx, out + 16, &n1, plaintext, len);
+  EVP_EncryptFinal_ex(ctx, out + 16 + n1, &n2);
+  EVP_CIPHER_CTX_free(ctx);
+  *outLen = 16 + n1 + n2;
+  return out;
+}
+
+static void BenchMessages(size_t msgLen, int iterations) {
+  unsigned char key[64] = "correct horse battery staple";
+  unsigned char msg[4096];
+  memset(msg, 'a', sizeof(msg));
+  int outLen;
+
+  double start = NowSeconds();
+  for (int i = 0; i < iterations; i++)
+    free(EncryptUncached(msg, (int)msgLen, key, &outLen));
+  double uncached = (NowSeconds() - start) / iterations * 1e9;
+
+  start = NowSeconds();
+  for (int i = 0; i < iterations; i++)
+    free(Crypto_EncryptAES256(msg, (int)msgLen, key, &outLen));
+  double cachedEnc = (NowSeconds() - start) / iterations * 1e9;
+
+  unsigned char sealed[4096 + 32];
+  start = NowSeconds();
+  for (int i = 0; i < iterations; i++)
+    Crypto_EncryptAES256Into(msg, (int)msgLen, key, sealed, sizeof(sealed));
+  double cachedInto = (NowSeconds() - start) / iterations * 1e9;
+
+  unsigned char *ct = Crypto_EncryptAES256(msg, (int)msgLen, key, &outLen);
+  int ptLen;
+  start = NowSeconds();
+  for (int i = 0; i < iterations; i++)
+    free(Crypto_DecryptAES256(ct, outLen, key, &ptLen));
+  double cachedDec = (NowSeconds() - start) / iterations * 1e9;
+  free(ct);
+
+  printf("aes-cbc  %5zu bytes  uncached enc %7.0f ns  cached enc %7.0f ns  "
+         "into %7.0f ns  cached dec %7.0f ns\n",
+         msgLen, uncached, cachedEnc, cachedInto, cachedDec);
+}
+
+// Record-sized AEAD throughput, the numbers the startup calibration compares.
+// Run with OPENSSL_ia32cap="~0x200000200000000" to see a host without AES-NI.
+static void BenchAEAD(int cipher, const unsigned char *buf, size_t len,
+                      int iterations) {
+  unsigned char key[CRYPTO_KEY_LEN] = "correct horse battery staple";
+  unsigned char nonce[CRYPTO_GCM_NONCE_LEN] = {0};
+  unsigned char *out = malloc(len + CRYPTO_GCM_TAG_LEN);
+  if (!out)
+    return;
+
+  double start = NowSeconds();
+  for (int i = 0; i < iterations; i++) {
+    memcpy(nonce, &i, sizeof(i));
+    Crypto_AEADSeal(cipher, key, nonce, NULL, 0, buf, (int)len, out,
+                    (int)len + CRYPTO_GCM_TAG_LEN);
+  }
+  double elapsed = NowSeconds() - start;
+  free(out);
+
+  double mb = (double)len * iterations / (1024.0 * 1024.0);
+  printf("%-18s %6zu bytes  %9.1f MB/s\n", Crypto_CipherName(cipher), len,
+         mb / elapsed);
+}
+
+// Seals len bytes as 16 KB records through the batch path with the given
+// thread count and returns MB/s. The sealed output is compared against the
+// single-threaded run to check that parallelism does not change it.
+#define BENCH_RECORD 16384
+#define BENCH_BATCH 16
+
+static double BenchBatch(int cipher, int threads, const unsigned char *buf,
+                         size_t len, unsigned char *out, int rounds) {
+  unsigned char key[CRYPTO_KEY_LEN] = "correct horse battery staple";
+  int records = (int)(len / BENCH_RECORD);
+  unsigned char(*nonces)[CRYPTO_GCM_NONCE_LEN] =
+      calloc(records, CRYPTO_GCM_NONCE_LEN);
+  CryptoAEADJob *jobs = calloc(records, sizeof(CryptoAEADJob));
+  if (!nonces || !jobs) {
+    free(nonces);
+    free(jobs);
+    return 0;
+  }
+  for (int i = 0; i < records; i++) {
+    memcpy(nonces[i] + 4, &i, sizeof(i));
+    jobs[i] = (CryptoAEADJob){nonces[i],
+                              NULL,
+                              0,
+                              buf + (size_t)i * BENCH_RECORD,
+                              BENCH_RECORD,
+                              out + (size_t)i * (BENCH_RECORD + 16),
+                              BENCH_RECORD + 16,
+                              0};
+  }
+
+  Crypto_SetParallelism(threads);
+  double start = NowSeconds();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < records; i += BENCH_BATCH) {
+      int n = records - i < BENCH_BATCH ? records - i : BENCH_BATCH;
+      Crypto_AEADSealBatch(cipher, key, jobs + i, n);
+    }
+  }
+  double elapsed = NowSeconds() - start;
+  free(nonces);
+  free(jobs);
+  return (double)len * rounds / (1024.0 * 1024.0) / elapsed;
+}
+
+static void BenchParallel(int cipher, const unsigned char *buf, size_t len) {
+  size_t sealedLen = len / BENCH_RECORD * (BENCH_RECORD + 16);
+  unsigned char *serial = malloc(sealedLen);
+  unsigned char *parallel = malloc(sealedLen);
+  if (!serial || !parallel) {
+    free(serial);
+    free(parallel);
+    return;
+  }
+
+  double one = BenchBatch(cipher, 1, buf, len, serial, 3);
+  Crypto_SetParallelism(0);
+  int threads = Crypto_Parallelism();
+  double all = BenchBatch(cipher, 0, buf, len, parallel, 3);
+  printf("%-18s %5zu MB  1 thread %8.1f MB/s  %d threads %8.1f MB/s  "
+         "(x%.2f, output %s)\n",
+         Crypto_CipherName(cipher), len >> 20, one, threads, all, all / one,
+         memcmp(serial, parallel, sealedLen) == 0 ? "identical" : "DIFFERS");
+  free(serial);
+  free(parallel);
+}
+
+int main(void) {
+  const size_t frameSize = 10 * 1024 * 1024;
+  unsigned char *buf = malloc(frameSize);
+  if (!buf)
+    return 1;
+  for (size_t i = 0; i < frameSize; i++)
+    buf[i] = (unsigned char)(i * 2654435761u >> 24);
+
+  printf("== checksums ==\n");
+  BenchCRC("crc32", false, buf, 64, 200000);
+  BenchCRC("crc32", false, buf, frameSize, 20);
+  BenchCRC("crc32c", true, buf, 64, 200000);
+  BenchCRC("crc32c", true, buf, frameSize, 20);
+  BenchHash(buf, 64, 200000);
+  BenchHash(buf, frameSize, 20);
+
+  printf("== per-message cipher overhead ==\n");
+  BenchMessages(16, 200000);
+  BenchMessages(64, 200000);
+  BenchMessages(256, 100000);
+  BenchMessages(4096, 20000);
+
+  printf("== AEAD seal (preferred here: %s) ==\n",
+         Crypto_CipherName(Crypto_PreferredCipher()));
+  BenchAEAD(CRYPTO_CIPHER_AES256_GCM, buf, 16384, 20000);
+  BenchAEAD(CRYPTO_CIPHER_CHACHA20_POLY1305, buf, 16384, 20000);
+
+  printf("== parallel record sealing (batches of %d x 16 KB) ==\n",
+         BENCH_BATCH);
+  BenchParallel(CRYPTO_CIPHER_AES256_GCM, buf, frameSize);
+  BenchParallel(CRYPTO_CIPHER_CHACHA20_POLY1305, buf, frameSize);
+
+  Crypto_Cleanup();
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,382 @@
+// Load generator for the receive path in src/network.c. Forks -n senders
+// that each stream -m chat lines and a -f MB file to a server running in this
+// process, then reports what the server side spent on them: wall time,
+// read(2)- and write(2)-family calls, which include file writes but not
+// socket receives or io_uring_enter (from /proc/self/io), context switches
+// and CPU time.
+//
+// Ping round trips are taken twice: before the load, in bursts of
+// LOADGEN_PING_BURST back-to-back pings, where Nagle's algorithm and delayed
+// ACKs show; and every 10 ms under load, where the pongs queue behind the
+// file data in the socket buffers. -N, -C, -q and -b change the socket tuning
+// on both ends.
+//
+// Build with `make loadgen`, run with `./bin/loadgen` for the io_uring
+// receive path and `./bin/loadgen -r` for recv(2) and stdio. For every
+// system call, run it under `strace -c -f` or `perf stat -e
+// 'syscalls:sys_enter_*'`.
+
+#include "common.h"
+#include "network.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOADGEN_TIMEOUT_SEC 300
+#define LOADGEN_PING_MS 10
+#define LOADGEN_PING_BURST 4
+#define LOADGEN_IDLE_ROUNDS 100
+
+typedef struct {
+  int peers;
+  int messages;
+  int fileMB;
+  int port;
+  bool useUring;
+  SocketTuning tuning;
+} LoadConfig;
+
+typedef struct {
+  double seconds;
+  double cpu;
+  long voluntary;
+  long involuntary;
+  unsigned long long readCalls;
+  unsigned long long writeCalls;
+} LoadSample;
+
+static double NowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void SleepMs(int ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+// Whole-process counters, less the main thread's switches: it only polls
+// for the finished files
+static void Sample(LoadSample *s) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  s->seconds = NowSeconds();
+  s->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  s->voluntary = ru.ru_nvcsw;
+  s->involuntary = ru.ru_nivcsw;
+  s->readCalls = s->writeCalls = 0;
+  char line[128];
+  snprintf(line, sizeof(line), "/proc/self/task/%d/status", (int)getpid());
+  FILE *f = fopen(line, "r");
+  if (f) {
+    long n;
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1)
+        s->voluntary -= n;
+      if (sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1)
+        s->involuntary -= n;
+    }
+    fclose(f);
+  }
+  if (!(f = fopen("/proc/self/io", "r")))
+    return;
+  while (fgets(line, sizeof(line), f)) {
+    sscanf(line, "syscr: %llu", &s->readCalls);
+    sscanf(line, "syscw: %llu", &s->writeCalls);
+  }
+  fclose(f);
+}
+
+static AppState *NewState(const LoadConfig *cfg) {
+  AppState *state = calloc(1, sizeof(AppState));
+  if (!state)
+    return NULL;
+  state->messageMutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+  state->connection.peerMutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+  state->frameChecksum = true;
+  state->connectTimeoutMs = 5000;
+  state->useUring = cfg->useUring;
+  state->tuning = cfg->tuning;
+  return state;
+}
+
+// A 16-bit mono WAV of noise, so the server takes it as audio
+static bool WriteCarrier(const char *path, int megabytes) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return false;
+  uint32_t dataLen = (uint32_t)megabytes * 1024 * 1024;
+  unsigned char header[44] = "RIFF\0\0\0\0WAVEfmt ";
+  uint32_t fields[] = {16, 1 | (1 << 16), 44100, 88200, 2 | (16 << 16)};
+  memcpy(header + 16, fields, sizeof(fields));
+  memcpy(header + 36, "data", 4);
+  memcpy(header + 40, &dataLen, 4);
+  uint32_t riffLen = dataLen + 36;
+  memcpy(header + 4, &riffLen, 4);
+  bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+  unsigned char block[64 * 1024];
+  uint32_t seed = 2463534242u;
+  for (uint32_t done = 0; ok && done < dataLen; done += sizeof(block)) {
+    for (size_t i = 0; i < sizeof(block); i++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      block[i] = (unsigned char)seed;
+    }
+    ok = fwrite(block, 1, sizeof(block), f) == sizeof(block);
+  }
+  return fclose(f) == 0 && ok;
+}
+
+// Sender: connects, waits for the go byte, sends everything, then stays
+// connected until the pipe closes
+static int RunSender(const LoadConfig *cfg, int index, int goFd) {
+  AppState *state = NewState(cfg);
+  if (!state)
+    return 1;
+  for (int tries = 0; tries < 100 && !state->connection.isConnected; tries++) {
+    InitializeConnection(state, false, "127.0.0.1", cfg->port);
+    if (!state->connection.isConnected)
+      SleepMs(50);
+  }
+  if (!state->connection.isConnected)
+    return 1;
+
+  char go;
+  if (read(goFd, &go, 1) != 1)
+    return 1;
+  char line[64];
+  for (int i = 0; i < cfg->messages; i++) {
+    snprintf(line, sizeof(line), "peer %d line %d", index, i);
+    SendMessage(state, line, MSG_TEXT);
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "peer%d.wav", index);
+  SendFile(state, path, MSG_AUDIO);
+
+  while (read(goFd, &go, 1) > 0)
+    ;
+  CloseConnection(state);
+  return 0;
+}
+
+static int CountConnected(AppState *state) {
+  int count = 0;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    if (state->connection.peers[i].isConnected)
+      count++;
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  return count;
+}
+
+static void ReportRtt(FILE *report, const char *label, bool timed,
+                      const RttStats *rtt) {
+  if (!timed) {
+    fprintf(report, "  %-13s no pongs\n", label);
+    return;
+  }
+  fprintf(report,
+          "  %-13s p50 %.3f ms, p99 %.3f ms, max %.3f ms (%llu of %llu "
+          "answered; worst peer)\n",
+          label, rtt->p50Ms, rtt->p99Ms, rtt->maxMs,
+          (unsigned long long)rtt->pongs, (unsigned long long)rtt->pings);
+}
+
+static int CountReceived(const LoadConfig *cfg) {
+  int count = 0;
+  char path[64];
+  struct stat st;
+  for (int i = 0; i < cfg->peers; i++) {
+    snprintf(path, sizeof(path), "received_peer%d.wav", i);
+    if (stat(path, &st) == 0)
+      count++;
+  }
+  return count;
+}
+
+static void Cleanup(const LoadConfig *cfg) {
+  char path[64];
+  for (int i = 0; i < cfg->peers; i++) {
+    snprintf(path, sizeof(path), "peer%d.wav", i);
+    remove(path);
+    snprintf(path, sizeof(path), "received_peer%d.wav", i);
+    remove(path);
+  }
+}
+
+static void Usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-n peers] [-m messages] [-f MB] [-p port] [-r] [-N] "
+          "[-C] [-q] [-b bytes]\n"
+          "  -r  receive with recv(2) and stdio instead of io_uring\n"
+          "  -N  leave Nagle's algorithm on (no TCP_NODELAY)\n"
+          "  -C  do not cork file slices\n"
+          "  -q  rearm TCP_QUICKACK after small frames\n"
+          "  -b  SO_SNDBUF and SO_RCVBUF, instead of autotuning\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  LoadConfig cfg = {4, 2000, 64, PORT + 100, true, {0}};
+  // The app's defaults
+  cfg.tuning.noDelay = true;
+  cfg.tuning.corkBulk = true;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:f:p:rNCqb:")) != -1) {
+    switch (opt) {
+    case 'n':
+      cfg.peers = atoi(optarg);
+      break;
+    case 'm':
+      cfg.messages = atoi(optarg);
+      break;
+    case 'f':
+      cfg.fileMB = atoi(optarg);
+      break;
+    case 'p':
+      cfg.port = atoi(optarg);
+      break;
+    case 'r':
+      cfg.useUring = false;
+      break;
+    case 'N':
+      cfg.tuning.noDelay = false;
+      break;
+    case 'C':
+      cfg.tuning.corkBulk = false;
+      break;
+    case 'q':
+      cfg.tuning.quickAck = true;
+      break;
+    case 'b':
+      cfg.tuning.sendBufferBytes = cfg.tuning.recvBufferBytes = atoi(optarg);
+      break;
+    default:
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+  if (cfg.peers < 1 || cfg.peers > MAX_CLIENTS || cfg.messages < 0 ||
+      cfg.fileMB < 1) {
+    Usage(argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  // Carriers go out from, and land in, a scratch directory
+  char dir[] = "/tmp/loadgen.XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir) != 0) {
+    perror("loadgen");
+    return 1;
+  }
+  for (int i = 0; i < cfg.peers; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "peer%d.wav", i);
+    if (!WriteCarrier(path, cfg.fileMB)) {
+      perror("loadgen");
+      return 1;
+    }
+  }
+  // The logger echoes every line to stdout; keep it out of the report
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  if (!report || !freopen("/dev/null", "w", stdout))
+    return 1;
+
+  // Senders are forked before the server starts any threads
+  int goPipe[2];
+  if (pipe(goPipe) != 0)
+    return 1;
+  pid_t *senders = calloc(cfg.peers, sizeof(pid_t));
+  for (int i = 0; i < cfg.peers; i++) {
+    senders[i] = fork();
+    if (senders[i] == 0) {
+      close(goPipe[1]);
+      _exit(RunSender(&cfg, i, goPipe[0]));
+    }
+  }
+  close(goPipe[0]);
+
+  AppState *server = NewState(&cfg);
+  StartConnection(server, true, "0.0.0.0", cfg.port);
+  double deadline = NowSeconds() + 10;
+  while (CountConnected(server) < cfg.peers && NowSeconds() < deadline)
+    SleepMs(10);
+  int connected = CountConnected(server);
+
+  for (int i = 0; i < LOADGEN_IDLE_ROUNDS; i++) {
+    for (int j = 0; j < LOADGEN_PING_BURST; j++)
+      SendPing(server);
+    SleepMs(LOADGEN_PING_MS);
+  }
+  SleepMs(100);
+  RttStats idleRtt, loadedRtt;
+  bool idleTimed = GetRttStats(server, &idleRtt);
+  ResetRttStats(server);
+
+  LoadSample before, after;
+  Sample(&before);
+  for (int i = 0; i < connected; i++) {
+    char go = 1;
+    if (write(goPipe[1], &go, 1) != 1)
+      break;
+  }
+  deadline = NowSeconds() + LOADGEN_TIMEOUT_SEC;
+  int received = 0;
+  double nextPing = 0;
+  while ((received = CountReceived(&cfg)) < connected &&
+         NowSeconds() < deadline) {
+    if (NowSeconds() >= nextPing) {
+      SendPing(server);
+      nextPing = NowSeconds() + LOADGEN_PING_MS / 1000.0;
+    }
+    SleepMs(5);
+  }
+  Sample(&after);
+  // Late pongs still count
+  SleepMs(100);
+  bool loadedTimed = GetRttStats(server, &loadedRtt);
+
+  close(goPipe[1]);
+  for (int i = 0; i < cfg.peers; i++)
+    waitpid(senders[i], NULL, 0);
+  CloseConnection(server);
+  Cleanup(&cfg);
+  rmdir(dir);
+
+  double seconds = after.seconds - before.seconds;
+  double megabytes = (double)received * cfg.fileMB;
+  fprintf(report, "%d of %d peers, %d lines and %d MB each, received %s\n",
+          connected, cfg.peers, cfg.messages, cfg.fileMB,
+          cfg.useUring ? "through io_uring (where available)"
+                       : "with recv(2) and stdio");
+  fprintf(report, "  files done    %d in %.3f s (%.1f MB/s)\n", received,
+          seconds, megabytes / seconds);
+  fprintf(report, "  read calls    %llu (file and pipe)\n",
+          after.readCalls - before.readCalls);
+  fprintf(report, "  write calls   %llu (file and pipe)\n",
+          after.writeCalls - before.writeCalls);
+  fprintf(report, "  ctx switches  %ld voluntary, %ld involuntary\n",
+          after.voluntary - before.voluntary,
+          after.involuntary - before.involuntary);
+  fprintf(report, "  cpu           %.3f s\n", after.cpu - before.cpu);
+  ReportRtt(report, "idle rtt", idleTimed, &idleRtt);
+  ReportRtt(report, "loaded rtt", loadedTimed, &loadedRtt);
+  fprintf(report,
+          "  tuning        nodelay %d, cork %d, quickack %d, buffers %d%s\n",
+          cfg.tuning.noDelay, cfg.tuning.corkBulk, cfg.tuning.quickAck,
+          cfg.tuning.sendBufferBytes,
+          cfg.tuning.sendBufferBytes ? " bytes" : " (autotuned)");
+  fclose(report);
+  free(senders);
+  free(server);
+  return received == cfg.peers ? 0 : 1;
+}
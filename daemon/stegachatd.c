@@ -0,0 +1,793 @@
+// Headless hub for StegaChat clients. Speaks the frame protocol of
+// src/network.c and routes frames between any number of clients on a single
+// epoll thread, without decoding them: carriers, hidden messages and their
+// encryption pass through untouched, so the hub never needs a key.
+// Build with `make daemon`, run with `./bin/stegachatd [-p port] [-m max]`.
+//
+// Every client is sent the others' chat lines and files. Files go through
+// one at a time; the hub stands in for the receivers towards the sender,
+// asking it to resume when a chunk goes missing and confirming the file
+// once it has passed it on whole, so a slow or reconnecting receiver never
+// rewinds a transfer for everyone else. A sender that offers a file while
+// another one streams is refused and can send it again later.
+//
+// A client has RELAY_HELLO_TIMEOUT_SEC to send its hello, and until then may
+// only send a frame the size of one. A sender whose file makes no progress
+// for RELAY_FLOOR_IDLE_SEC, while every receiver keeps up, loses its turn.
+// Frames are buffered only as their bytes arrive, so a length prefix alone
+// costs the hub nothing.
+//
+// Clients connect as they would to a GUI server, with the wire encryption
+// toggle off (the hub has no key to open records with) and without TLS.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "logging.h"
+#include "protocol.h"
+#include "transport.h"
+
+// Received bytes are read this much at a time; frames complete in it are
+// routed straight from there
+#define RELAY_READ_BYTES (256 * 1024)
+// A receiver this far behind stops the file sender until it is back under
+// the low mark; one past the hard cap is dropped
+#define RELAY_HIGH_WATER (8 * 1024 * 1024)
+#define RELAY_LOW_WATER (2 * 1024 * 1024)
+#define RELAY_MAX_BACKLOG (64 * 1024 * 1024)
+#define RELAY_MAX_IOV 64
+#define RELAY_EVENTS 256
+// Largest frame a client may send before its hello: the hello itself, with
+// type byte and CRC trailer
+#define RELAY_HELLO_FRAME_BYTES (1 + TRANSPORT_HELLO_LEN + 4)
+#define RELAY_HELLO_TIMEOUT_SEC 10
+#define RELAY_FLOOR_IDLE_SEC 30
+// A frame split across reads gets a buffer this big at first, doubled as
+// more of it arrives
+#define RELAY_PARTIAL_MIN (64 * 1024)
+
+// One received frame, length prefix included, exactly as it goes out again.
+// Every receiver's queue holds a reference instead of a copy.
+typedef struct Block {
+  unsigned refs;
+  size_t len;
+  unsigned char data[];
+} Block;
+
+typedef struct Out {
+  Block *block;
+  struct Out *next;
+} Out;
+
+typedef struct Client {
+  int fd;
+  char addr[32];
+  bool greeted; // Its hello has arrived
+  bool closing;
+  long joinedAt; // Monotonic seconds, for the hello deadline
+  // Bytes of a frame split across reads: the length prefix so far, then the
+  // frame itself once its size is known, in a block with room for
+  // partialCap of its partial->len bytes
+  unsigned char head[4];
+  size_t headLen;
+  Block *partial;
+  size_t partialLen;
+  size_t partialCap;
+  // Frames waiting for the socket, the first outOff bytes in already gone
+  Out *outHead, *outTail;
+  size_t outOff;
+  size_t outBytes;
+  bool congested;  // Over RELAY_HIGH_WATER, not yet back under the low mark
+  bool dirty;      // Queued to since the last flush
+  uint32_t events; // What epoll watches it for
+  struct Client *prev, *next;
+  struct Client *nextDirty, *nextDead;
+} Client;
+
+// The transfer being passed on, seen as its one receiver would
+typedef struct {
+  Client *sender; // NULL when no file is streaming
+  uint64_t id;
+  uint64_t size;
+  uint64_t received;
+  bool resumeRequested;
+  uint32_t resumes;
+  long activeAt; // Monotonic seconds of the last progress
+} Floor;
+
+typedef struct {
+  int epollFd;
+  int listenFd;
+  int maxClients;
+  int clientCount;
+  int ungreetedCount;
+  int congestedCount;
+  Client *clients;
+  Client *dirty;
+  Client *dead; // Closed this round, freed once no event can name them
+  Floor floor;
+  unsigned char readBuf[RELAY_READ_BYTES];
+} Hub;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void OnSignal(int sig) { stopRequested = 1; }
+
+static long NowSec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void PutBE32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (unsigned char)(v >> (24 - 8 * i));
+}
+
+static uint32_t GetBE32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void PutBE64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+static uint64_t GetBE64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static Block *Block_New(size_t len) {
+  Block *b = malloc(sizeof(Block) + len);
+  if (!b)
+    return NULL;
+  b->refs = 1;
+  b->len = len;
+  return b;
+}
+
+static void Block_Release(Block *b) {
+  if (b && --b->refs == 0)
+    free(b);
+}
+
+// A frame of the hub's own, without a CRC trailer
+static Block *Block_Frame(MessageType type, const unsigned char *payload,
+                          size_t payloadLen) {
+  Block *b = Block_New(5 + payloadLen);
+  if (!b)
+    return NULL;
+  PutBE32(b->data, (uint32_t)(1 + payloadLen));
+  b->data[4] = (unsigned char)type;
+  if (payloadLen)
+    memcpy(b->data + 5, payload, payloadLen);
+  return b;
+}
+
+static void Watch(Hub *hub, Client *c, uint32_t events) {
+  if (c->closing || c->events == events)
+    return;
+  struct epoll_event ev = {.events = events, .data.ptr = c};
+  epoll_ctl(hub->epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->events = events;
+}
+
+// The file sender is only read from while every receiver keeps up
+static void UpdateSenderWatch(Hub *hub) {
+  Client *s = hub->floor.sender;
+  if (!s)
+    return;
+  uint32_t events = s->events & EPOLLOUT;
+  if (hub->congestedCount == 0)
+    events |= EPOLLIN;
+  Watch(hub, s, events);
+}
+
+static void NoteBacklog(Hub *hub, Client *c) {
+  bool congested = c->congested ? c->outBytes > RELAY_LOW_WATER
+                                : c->outBytes > RELAY_HIGH_WATER;
+  if (congested == c->congested)
+    return;
+  c->congested = congested;
+  hub->congestedCount += congested ? 1 : -1;
+  UpdateSenderWatch(hub);
+}
+
+static void CloseClient(Hub *hub, Client *c, const char *why);
+
+// Queues a reference to b for c; it goes out with the next flush
+static void Send(Hub *hub, Client *c, Block *b) {
+  if (c->closing || !b)
+    return;
+  Out *o = malloc(sizeof(Out));
+  if (!o) {
+    CloseClient(hub, c, "out of memory");
+    return;
+  }
+  b->refs++;
+  o->block = b;
+  o->next = NULL;
+  if (c->outTail)
+    c->outTail->next = o;
+  else
+    c->outHead = o;
+  c->outTail = o;
+  c->outBytes += b->len;
+  if (c->outBytes > RELAY_MAX_BACKLOG) {
+    CloseClient(hub, c, "too far behind");
+    return;
+  }
+  NoteBacklog(hub, c);
+  if (!c->dirty) {
+    c->dirty = true;
+    c->nextDirty = hub->dirty;
+    hub->dirty = c;
+  }
+}
+
+static void SendOwn(Hub *hub, Client *c, MessageType type,
+                    const unsigned char *payload, size_t payloadLen) {
+  Block *b = Block_Frame(type, payload, payloadLen);
+  Send(hub, c, b);
+  Block_Release(b);
+}
+
+// Sends b to every greeted client but from. A client closed on the way keeps
+// its next link until the round ends, so the walk goes on past it.
+static void Broadcast(Hub *hub, Client *from, Block *b) {
+  for (Client *c = hub->clients; c; c = c->next)
+    if (c != from && c->greeted && !c->closing)
+      Send(hub, c, b);
+}
+
+static void Flush(Hub *hub, Client *c) {
+  while (c->outHead && !c->closing) {
+    struct iovec iov[RELAY_MAX_IOV];
+    int n = 0;
+    size_t off = c->outOff;
+    for (Out *o = c->outHead; o && n < RELAY_MAX_IOV; o = o->next) {
+      iov[n++] = (struct iovec){o->block->data + off, o->block->len - off};
+      off = 0;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+    ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (sent < 0) {
+      CloseClient(hub, c, strerror(errno));
+      return;
+    }
+    c->outBytes -= sent;
+    while (sent > 0) {
+      Out *o = c->outHead;
+      size_t left = o->block->len - c->outOff;
+      if ((size_t)sent < left) {
+        c->outOff += sent;
+        break;
+      }
+      sent -= left;
+      c->outOff = 0;
+      c->outHead = o->next;
+      Block_Release(o->block);
+      free(o);
+    }
+    if (!c->outHead)
+      c->outTail = NULL;
+  }
+  NoteBacklog(hub, c);
+  uint32_t events = (c->events & EPOLLIN) | (c->outHead ? EPOLLOUT : 0);
+  Watch(hub, c, events);
+}
+
+// Ends the streaming transfer for good; receivers read the empty
+// MSG_FILE_END as the sender giving up unless it finished
+static void ReleaseFloor(Hub *hub, bool finished) {
+  Client *s = hub->floor.sender;
+  memset(&hub->floor, 0, sizeof(hub->floor));
+  if (!finished) {
+    Block *end = Block_Frame(MSG_FILE_END, NULL, 0);
+    Broadcast(hub, s, end);
+    Block_Release(end);
+  }
+  if (s && !s->closing)
+    Watch(hub, s, EPOLLIN | (s->events & EPOLLOUT));
+}
+
+static void CloseClient(Hub *hub, Client *c, const char *why) {
+  if (c->closing)
+    return;
+  LOG_INFO("Client %s left: %s", c->addr, why);
+  c->closing = true;
+  if (c->congested)
+    hub->congestedCount--;
+  c->congested = false;
+  epoll_ctl(hub->epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    hub->clients = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  c->nextDead = hub->dead;
+  hub->dead = c;
+  hub->clientCount--;
+  if (!c->greeted)
+    hub->ungreetedCount--;
+  if (hub->floor.sender == c)
+    ReleaseFloor(hub, false);
+  else
+    UpdateSenderWatch(hub);
+}
+
+static void FreeClient(Client *c) {
+  while (c->outHead) {
+    Out *o = c->outHead;
+    c->outHead = o->next;
+    Block_Release(o->block);
+    free(o);
+  }
+  Block_Release(c->partial);
+  free(c);
+}
+
+static void RequestResume(Hub *hub) {
+  Floor *f = &hub->floor;
+  unsigned char payload[16];
+  PutBE64(payload, f->id);
+  PutBE64(payload + 8, f->received);
+  SendOwn(hub, f->sender, MSG_FILE_RESUME, payload, sizeof(payload));
+  f->resumeRequested = true;
+  f->resumes++;
+}
+
+// MSG_FILE_BEGIN [Type: 1] [Name length: 4] [Name] [Size: 8] [ID: 8]
+static void BeginFile(Hub *hub, Client *c, Block *b, const unsigned char *data,
+                      size_t len) {
+  if (len < 5 || len != 5 + (size_t)GetBE32(data + 1) + 16)
+    return;
+  uint64_t size = GetBE64(data + len - 16);
+  uint64_t id = GetBE64(data + len - 8);
+  Floor *f = &hub->floor;
+  if (f->sender && f->sender != c) {
+    LOG_INFO("Refusing a file from %s while %s sends one", c->addr,
+             f->sender->addr);
+    unsigned char payload[8];
+    PutBE64(payload, id);
+    SendOwn(hub, c, MSG_FILE_REJECT, payload, sizeof(payload));
+    return;
+  }
+  if (f->sender)
+    ReleaseFloor(hub, false); // It moved on without finishing the last one
+  f->sender = c;
+  f->id = id;
+  f->size = size;
+  f->activeAt = NowSec();
+  Broadcast(hub, c, b);
+}
+
+// MSG_FILE_CHUNK [Offset: 8] [data]: only the slice continuing what was
+// passed on goes through
+static void RelayChunk(Hub *hub, Client *c, Block *b, const unsigned char *data,
+                       size_t len) {
+  Floor *f = &hub->floor;
+  if (f->sender != c || len < 8)
+    return;
+  uint64_t offset = GetBE64(data);
+  if (offset != f->received || len - 8 > f->size - f->received) {
+    if (!f->resumeRequested)
+      RequestResume(hub);
+    return;
+  }
+  f->resumeRequested = false;
+  f->received += len - 8;
+  f->activeAt = NowSec();
+  Broadcast(hub, c, b);
+}
+
+// MSG_FILE_END [SHA-256: 32] [Resumes: 4], or empty if the sender gave up
+static void FinishFile(Hub *hub, Client *c, Block *b, const unsigned char *data,
+                       size_t len) {
+  Floor *f = &hub->floor;
+  if (f->sender != c)
+    return;
+  if (len == 0) {
+    ReleaseFloor(hub, false);
+    return;
+  }
+  if (len != 32 + 4)
+    return;
+  if (f->received < f->size) {
+    // Same rule as a receiver: ask again unless our request is on its way
+    if (GetBE32(data + 32) == f->resumes)
+      RequestResume(hub);
+    return;
+  }
+  Broadcast(hub, c, b);
+  // Receivers check the hash themselves; the sender can forget the file
+  unsigned char payload[16];
+  PutBE64(payload, f->id);
+  PutBE64(payload + 8, f->size);
+  SendOwn(hub, c, MSG_FILE_RESUME, payload, sizeof(payload));
+  ReleaseFloor(hub, true);
+}
+
+// Routes one whole frame; b is only referenced, never kept by the caller
+static void HandleFrame(Hub *hub, Client *c, Block *b) {
+  unsigned char typeByte = b->data[4];
+  MessageType type = (MessageType)(typeByte & ~FRAME_FLAG_CRC);
+  const unsigned char *data = b->data + 5;
+  size_t len = b->len - 5;
+  // The CRC is left for the receivers to check
+  if (typeByte & FRAME_FLAG_CRC) {
+    if (len < 4)
+      return;
+    len -= 4;
+  }
+
+  if (!c->greeted) {
+    if (type != MSG_HELLO || len < TRANSPORT_HELLO_MIN_LEN ||
+        data[0] != TRANSPORT_HELLO_VERSION) {
+      CloseClient(hub, c, "no hello");
+    } else if (data[1] & TRANSPORT_HELLO_ENCRYPTED) {
+      CloseClient(hub, c, "encrypts the connection; turn wire encryption off");
+    } else {
+      c->greeted = true;
+      hub->ungreetedCount--;
+      LOG_INFO("Client %s joined (%d connected)", c->addr, hub->clientCount);
+    }
+    return;
+  }
+
+  switch (type) {
+  case MSG_PING:
+    // The client times the round trip from the payload it gets back
+    SendOwn(hub, c, MSG_PONG, data, len == PING_PAYLOAD_LEN ? len : 0);
+    break;
+  case MSG_TEXT:
+  case MSG_IMAGE:
+  case MSG_AUDIO:
+    Broadcast(hub, c, b);
+    break;
+  case MSG_FILE_BEGIN:
+    BeginFile(hub, c, b, data, len);
+    break;
+  case MSG_FILE_CHUNK:
+    RelayChunk(hub, c, b, data, len);
+    break;
+  case MSG_FILE_END:
+    FinishFile(hub, c, b, data, len);
+    break;
+  default:
+    // Hellos after the first, pongs, and the receivers' verdicts on files:
+    // the hub has already answered the sender for them
+    break;
+  }
+}
+
+// Takes whole frames off the front of data and returns how many bytes that
+// consumed; what is left is the start of a frame
+static size_t HandleFrames(Hub *hub, Client *c, const unsigned char *data,
+                           size_t len) {
+  size_t pos = 0;
+  while (len - pos >= 4 && !c->closing) {
+    uint32_t frameLen = GetBE32(data + pos);
+    uint32_t maxLen = c->greeted ? MAX_FRAME_BYTES : RELAY_HELLO_FRAME_BYTES;
+    if (frameLen == 0 || frameLen > maxLen) {
+      CloseClient(hub, c, "bad frame length");
+      break;
+    }
+    if (len - pos - 4 < frameLen)
+      break;
+    Block *b = Block_New(4 + frameLen);
+    if (!b) {
+      CloseClient(hub, c, "out of memory");
+      break;
+    }
+    memcpy(b->data, data + pos, 4 + frameLen);
+    HandleFrame(hub, c, b);
+    Block_Release(b);
+    pos += 4 + frameLen;
+  }
+  return pos;
+}
+
+// Makes room for more of a split frame once what it has is full: double the
+// buffer, up to the frame's size. Memory so follows the bytes that arrived,
+// not the length the client announced.
+static bool GrowPartial(Client *c) {
+  if (c->partialLen < c->partialCap)
+    return true;
+  size_t cap = c->partialCap * 2;
+  if (cap > c->partial->len)
+    cap = c->partial->len;
+  Block *b = realloc(c->partial, sizeof(Block) + cap);
+  if (!b)
+    return false;
+  c->partial = b;
+  c->partialCap = cap;
+  return true;
+}
+
+static void Receive(Hub *hub, Client *c) {
+  ssize_t n;
+  if (c->partial) {
+    // The rest of a large frame goes straight into its block
+    if (!GrowPartial(c)) {
+      CloseClient(hub, c, "out of memory");
+      return;
+    }
+    n = recv(c->fd, c->partial->data + c->partialLen,
+             c->partialCap - c->partialLen, MSG_DONTWAIT);
+    if (n > 0 && (c->partialLen += n) == c->partial->len) {
+      Block *b = c->partial;
+      c->partial = NULL;
+      HandleFrame(hub, c, b);
+      Block_Release(b);
+    }
+  } else {
+    memcpy(hub->readBuf, c->head, c->headLen);
+    n = recv(c->fd, hub->readBuf + c->headLen,
+             sizeof(hub->readBuf) - c->headLen, MSG_DONTWAIT);
+    if (n > 0) {
+      size_t len = c->headLen + n;
+      size_t used = HandleFrames(hub, c, hub->readBuf, len);
+      size_t left = len - used;
+      c->headLen = 0;
+      if (c->closing) {
+        // Nothing more to keep
+      } else if (left < 4) {
+        memcpy(c->head, hub->readBuf + used, left);
+        c->headLen = left;
+      } else {
+        size_t frameLen = 4 + GetBE32(hub->readBuf + used);
+        size_t cap = left > RELAY_PARTIAL_MIN ? left : RELAY_PARTIAL_MIN;
+        c->partial = malloc(sizeof(Block) + (cap < frameLen ? cap : frameLen));
+        if (!c->partial) {
+          CloseClient(hub, c, "out of memory");
+          return;
+        }
+        c->partial->refs = 1;
+        c->partial->len = frameLen;
+        memcpy(c->partial->data, hub->readBuf + used, left);
+        c->partialLen = left;
+        c->partialCap = cap < frameLen ? cap : frameLen;
+      }
+    }
+  }
+  if (n == 0)
+    CloseClient(hub, c, "disconnected");
+  else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    CloseClient(hub, c, strerror(errno));
+}
+
+static void AcceptClients(Hub *hub) {
+  for (;;) {
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int fd = accept(hub->listenFd, (struct sockaddr *)&addr, &addrLen);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        LOG_WARN("Accept failed: %s", strerror(errno));
+      return;
+    }
+    if (hub->clientCount >= hub->maxClients) {
+      LOG_WARN("Turning away %s: %d clients connected",
+               inet_ntoa(addr.sin_addr), hub->clientCount);
+      close(fd);
+      continue;
+    }
+    Client *c = calloc(1, sizeof(Client));
+    if (!c || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->joinedAt = NowSec();
+    snprintf(c->addr, sizeof(c->addr), "%s:%d", inet_ntoa(addr.sin_addr),
+             ntohs(addr.sin_port));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->events = EPOLLIN;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if (epoll_ctl(hub->epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    c->next = hub->clients;
+    if (hub->clients)
+      hub->clients->prev = c;
+    hub->clients = c;
+    hub->clientCount++;
+    hub->ungreetedCount++;
+
+    // Its hello, in cleartext and announcing no record encryption
+    unsigned char hello[TRANSPORT_HELLO_LEN] = {TRANSPORT_HELLO_VERSION};
+    hello[39] = CRYPTO_CIPHER_AES256_GCM;
+    hello[40] = 1u << CRYPTO_CIPHER_AES256_GCM;
+    SendOwn(hub, c, MSG_HELLO, hello, sizeof(hello));
+  }
+}
+
+// Once a second while anything is on a clock: clients that never said hello,
+// and a file sender that stopped sending
+static void Sweep(Hub *hub) {
+  long now = NowSec();
+  for (Client *c = hub->clients; c; c = c->next)
+    if (!c->greeted && now - c->joinedAt >= RELAY_HELLO_TIMEOUT_SEC)
+      CloseClient(hub, c, "no hello in time");
+  Floor *f = &hub->floor;
+  if (!f->sender)
+    return;
+  // A sender held back by slow receivers is not the one stalling
+  if (hub->congestedCount > 0) {
+    f->activeAt = now;
+  } else if (now - f->activeAt >= RELAY_FLOOR_IDLE_SEC) {
+    Client *s = f->sender;
+    uint64_t id = f->id;
+    LOG_INFO("%s stopped sending its file; releasing the floor", s->addr);
+    ReleaseFloor(hub, false);
+    unsigned char payload[8];
+    PutBE64(payload, id);
+    SendOwn(hub, s, MSG_FILE_REJECT, payload, sizeof(payload));
+  }
+}
+
+static int Listen(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Each client takes a descriptor; ask for as many as we may
+static void RaiseFileLimit(int maxClients) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+    return;
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  getrlimit(RLIMIT_NOFILE, &rl);
+  if (rl.rlim_cur < (rlim_t)maxClients + 16)
+    LOG_WARN("Only %llu file descriptors; fewer than %d clients will fit",
+             (unsigned long long)rl.rlim_cur, maxClients);
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [-p port] [-m max-clients]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+  int port = PORT;
+  int maxClients = 4096;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:m:h")) != -1) {
+    if (opt == 'p') {
+      port = atoi(optarg);
+    } else if (opt == 'm') {
+      maxClients = atoi(optarg);
+    } else {
+      Usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (port <= 0 || port > 65535 || maxClients <= 0) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  Logger_Init("stegachatd.log");
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction sa = {.sa_handler = OnSignal};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  RaiseFileLimit(maxClients);
+
+  Hub *hub = calloc(1, sizeof(Hub));
+  if (!hub)
+    return 1;
+  hub->maxClients = maxClients;
+  hub->listenFd = Listen(port);
+  hub->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (hub->listenFd < 0 || hub->epollFd < 0 ||
+      epoll_ctl(hub->epollFd, EPOLL_CTL_ADD, hub->listenFd, &ev) != 0) {
+    LOG_ERROR("Cannot listen on port %d: %s", port, strerror(errno));
+    return 1;
+  }
+  LOG_INFO("Relaying on port %d for up to %d clients", port, maxClients);
+
+  struct epoll_event events[RELAY_EVENTS];
+  long sweptAt = NowSec();
+  while (!stopRequested) {
+    // Idle with nothing on a clock, the hub sleeps until a socket wakes it
+    bool timed = hub->ungreetedCount > 0 || hub->floor.sender;
+    int n = epoll_wait(hub->epollFd, events, RELAY_EVENTS, timed ? 1000 : -1);
+    if (n < 0 && errno != EINTR) {
+      LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      Client *c = events[i].data.ptr;
+      if (!c) {
+        AcceptClients(hub);
+        continue;
+      }
+      if (c->closing)
+        continue;
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        Receive(hub, c);
+      if (!c->closing && (events[i].events & EPOLLOUT))
+        Flush(hub, c);
+    }
+    // Everything queued this round goes out in as few writes as it can
+    if (timed && NowSec() != sweptAt) {
+      sweptAt = NowSec();
+      Sweep(hub);
+    }
+    while (hub->dirty) {
+      Client *c = hub->dirty;
+      hub->dirty = c->nextDirty;
+      c->dirty = false;
+      if (!c->closing)
+        Flush(hub, c);
+    }
+    while (hub->dead) {
+      Client *c = hub->dead;
+      hub->dead = c->nextDead;
+      FreeClient(c);
+    }
+  }
+
+  LOG_INFO("Shutting down with %d clients connected", hub->clientCount);
+  while (hub->clients)
+    CloseClient(hub, hub->clients, "hub shutting down");
+  while (hub->dead) {
+    Client *c = hub->dead;
+    hub->dead = c->nextDead;
+    FreeClient(c);
+  }
+  close(hub->listenFd);
+  close(hub->epollFd);
+  free(hub);
+  Logger_Close();
+  return 0;
+}
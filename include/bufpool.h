@@ -0,0 +1,26 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+// Free lists of receive buffers in power-of-two size classes, so a steady
+// stream of frames reuses a handful of buffers instead of calling malloc per
+// message. Requests above the largest class are malloc'd and freed as is.
+// Not thread-safe: each receive thread keeps its own pool.
+#define BUFPOOL_MIN_SHIFT 12 // 4 KB
+#define BUFPOOL_CLASSES 9    // Up to 1 MB
+#define BUFPOOL_DEPTH 2      // Free buffers kept per class
+
+typedef struct {
+  void *free[BUFPOOL_CLASSES][BUFPOOL_DEPTH];
+  int count[BUFPOOL_CLASSES];
+} BufPool;
+
+// A buffer of at least len bytes, or NULL when out of memory
+void *BufPool_Get(BufPool *pool, size_t len);
+// Returns a buffer from BufPool_Get; len must be the length it was got with
+void BufPool_Put(BufPool *pool, void *buf, size_t len);
+// Frees every pooled buffer
+void BufPool_Clear(BufPool *pool);
+
+#endif
@@ -4,6 +4,11 @@
 #include <pthread.h>
 #include <raylib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+#include "protocol.h"
 
 typedef enum {
   ERR_NONE = 0,
@@ -18,18 +23,11 @@ typedef enum {
 #define MAX_MESSAGES 100
 #define MAX_MESSAGE_LENGTH 4096
 #define MAX_CLIENTS 10
-#define PORT 8888
 #define BUFFER_SIZE 1048576
-
-typedef enum {
-  MSG_TEXT,
-  MSG_IMAGE,
-  MSG_AUDIO,
-  MSG_FILE_CHUNK,
-  MSG_FILE_END,
-  MSG_PING,
-  MSG_PONG
-} MessageType;
+#define PING_WINDOW 8 // Pings that may await their pong at once, per peer
+// A link whose oldest unanswered ping is this old counts as dead and is dropped
+#define PING_TIMEOUT_SEC 10
+#define SEEN_MESSAGES 64 // Chat line IDs remembered to drop duplicates
 
 typedef struct {
   char sender[50];
@@ -40,32 +38,121 @@ typedef struct {
   char filename[256];
   bool hasHiddenMessage;
   char hiddenMessage[MAX_MESSAGE_LENGTH];
+  // Hex SHA-256 of an attached file (see hash.h), empty for text; usable as
+  // a cache or dedup key
+  char contentHash[65];
 } ChatMessage;
 
+struct Transport;
+struct SendQueue;
+struct HashCtx;
+struct BulkSend;
+struct Uring;
+struct Outbox;
+struct AppState;
+
+// What a connection started with StartConnection is waiting on
+typedef enum {
+  CONNECT_IDLE,      // No attempt running
+  CONNECT_LISTENING, // Server waiting for a peer
+  CONNECT_DIALING,   // Client waiting for connect() to finish
+  CONNECT_HANDSHAKE, // TLS handshake in progress
+  CONNECT_BACKOFF    // Client lost its link; waiting to dial again
+} ConnectPhase;
+
+// An incoming chunked transfer, streamed to disk as it arrives:
+//   MSG_FILE_BEGIN [Type: 1] [Name length: 4] [Name] [Size: 8] [ID: 8]
+//   MSG_FILE_CHUNK [Offset: 8] [data] ... (any number, any sizes)
+//   MSG_FILE_END   [SHA-256 of data: 32] [Resumes: 4], or empty if the
+//                  sender gave up
+// The receiver answers with MSG_FILE_REJECT [ID: 8] to refuse the file, or
+// MSG_FILE_RESUME [ID: 8] [Offset: 8] to have it sent on from offset: when a
+// chunk goes missing, when it still holds part of the file from an earlier
+// connection, and with offset = size once the file is verified, which lets
+// the sender forget it. Resumes counts the requests the sender acted on, so
+// the receiver can tell whether one is still on its way.
 typedef struct {
-  char localIP[20];
+  char filename[256];
+  char partPath[512]; // Written here, renamed once the hash checks out
+  FILE *file;
+  struct HashCtx *hash;
+  uint64_t id;
+  uint64_t size;
+  uint64_t received;
+  bool isReceiving;
+  bool suspended; // Connection dropped; partPath keeps what was received
+  bool resumeRequested; // Dropping chunks until the one at received
+  uint32_t resumes;     // MSG_FILE_RESUMEs sent on this connection
+  MessageType fileType;
+} FileTransfer;
+
+// One link of a connection: a client has one, a server one per peer
+typedef struct {
+  struct AppState *app;
+  char name[50]; // Sender shown on this peer's chat lines
   char remoteIP[20];
-  int localPort;
   int remotePort;
   bool isConnected;
   int socket_fd;
+  struct Transport *transport;
+  struct SendQueue *sendQueue; // Outbound frames, drained by sendThread
+  pthread_t sendThread;
+  // Our transfers a dropped link left unfinished, and the peer they were
+  // going to; the next link to that peer picks them up
+  struct BulkSend *suspendedSends;
+  char suspendedPeer[20];
   pthread_t receiveThread;
   bool threadActive;
-  float lastPingSent;
-  float lastPongReceived;
-  float latency;
-} ConnectionInfo;
+  struct Uring *ring; // Receive thread's io_uring, if it has one (uring.h)
+  FileTransfer transfer; // What this peer is sending us
+  // Send times of pings awaiting their pong, by sequence number modulo
+  // PING_WINDOW; a slot goes back to 0 when its pong arrives, so late
+  // duplicates and pongs to pings nobody sent are not timed
+  atomic_uint_fast64_t pingSentNs[PING_WINDOW];
+  atomic_uint_fast64_t pingSeq; // Next ping's sequence number
+  // Send time of the first ping since the last pong, or 0
+  atomic_uint_fast64_t unansweredSinceNs;
+  Histogram rtt;                 // Round trips of answered pings
+} Peer;
 
 typedef struct {
-  char filename[256];
-  unsigned char *data;
-  size_t size;
-  size_t received;
-  bool isReceiving;
-  MessageType fileType;
-} FileTransfer;
+  char localIP[20];
+  int localPort;
+  bool isConnected; // At least one peer is
+  Peer peers[MAX_CLIENTS];
+  // Guards links coming and going against threads sending to every peer
+  pthread_mutex_t peerMutex;
+  // Background attempt from StartConnection: connectThread is joined by the
+  // next Start/CloseConnection, and cancelFd (an eventfd) cuts it short. A
+  // server's keeps accepting peers until then.
+  pthread_t connectThread;
+  bool connectPending;
+  int cancelFd;
+  ConnectPhase connectPhase;
+  double connectStarted; // GetTime() when the attempt began
+  // A background client dials again after losing its link: the receive
+  // thread signals linkDownFd (an eventfd) when it ends, and the connect
+  // thread waits out a backoff before redialing at GetTime() redialAt
+  bool redial;
+  int linkDownFd;
+  int redialAttempt;
+  double redialAt;
+  float lastPingSent;    // GetTime() of the last round of pings, for pacing
+} ConnectionInfo;
 
+// Socket options for every link, by message class: chat lines and control
+// frames want each frame on the wire at once, file slices want full segments
 typedef struct {
+  bool noDelay;  // TCP_NODELAY, so a small frame never waits on an ACK
+  bool corkBulk; // TCP_CORK while streaming a file, released for small frames
+                 // and once the writer goes idle
+  int sendBufferBytes; // SO_SNDBUF and SO_RCVBUF; 0 leaves the kernel
+  int recvBufferBytes; // autotuning them
+  bool quickAck;       // TCP_QUICKACK after each small frame received
+  int keepAliveSec;    // Idle seconds before keepalive probes; 0 for none
+} SocketTuning;
+
+typedef struct AppState {
   ChatMessage messages[MAX_MESSAGES];
   int messageCount;
   ConnectionInfo connection;
@@ -75,7 +162,14 @@ typedef struct {
   bool hiddenMessageEditMode;
   float scrollOffset;
   bool isServer;
-  FileTransfer currentTransfer;
+  // IDs of the last files received whole, so a sender that missed our
+  // confirmation and offers one again is told it is done
+  uint64_t finishedTransfers[8];
+  int finishedNext;
+  // IDs of the last chat lines shown, under messageMutex, so a line sent
+  // again after a reconnect or restart is shown once
+  uint64_t seenMessages[SEEN_MESSAGES];
+  int seenNext;
   pthread_mutex_t messageMutex;
   bool showConnectionDialog;
   char serverIPBuffer[20];
@@ -106,10 +200,41 @@ typedef struct {
   bool ytUrlEditMode;
   bool isDownloading;
 
+  // Append a CRC32C trailer to every outgoing frame
+  bool frameChecksum;
+
   // Encryption state
   bool useEncryption;
   char encryptionKey[64];
   bool encryptionKeyEditMode;
+  // Also encrypt the connection itself with the key (see transport.h)
+  bool encryptTransport;
+
+  // How long a client waits for connect() and a server for a peer; 0 waits
+  // until cancelled
+  int connectTimeoutMs;
+  int acceptTimeoutMs;
+  // A client started with StartConnection dials again, with backoff, when
+  // an established link drops
+  bool autoReconnect;
+  // Chat lines written while no peer is connected wait here, on disk, and
+  // go out in order on the next link (see outbox.h); NULL drops them
+  struct Outbox *outbox;
+
+  // Receive and save files through io_uring where the kernel has it (see
+  // uring.h); recv(2) and stdio otherwise
+  bool useUring;
+
+  SocketTuning tuning;
+
+  // Run the connection over TLS 1.3 instead (see tls.h). A client verifies
+  // the server against tlsCAPath and will not connect without it unless
+  // tlsInsecure is set.
+  bool useTLS;
+  bool tlsInsecure;
+  char tlsCertPath[256];
+  char tlsKeyPath[256];
+  char tlsCAPath[256];
 
   // Search Filter
   char filterBuffer[256];
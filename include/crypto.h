@@ -7,13 +7,154 @@
 
 extern bool crypto_init_done;
 
+#define CRYPTO_KEY_LEN 32
+#define CRYPTO_CBC_IV_LEN 16
+
 void Crypto_Init(void);
 void Crypto_Cleanup(void);
 
 unsigned char* Crypto_EncryptAES256(const unsigned char *plaintext, int plaintext_len, const unsigned char *key, int *out_len);
 unsigned char* Crypto_DecryptAES256(const unsigned char *ciphertext_with_iv, int ciphertext_len, const unsigned char *key, int *out_len);
+
+// AES-256-GCM. Output layout is [nonce][ciphertext][tag]; aad is
+// authenticated but not encrypted. Decrypt returns NULL if the tag does not
+// verify.
+#define CRYPTO_GCM_NONCE_LEN 12
+#define CRYPTO_GCM_TAG_LEN 16
+unsigned char *Crypto_EncryptAES256GCM(const unsigned char *plaintext,
+                                       int plaintext_len,
+                                       const unsigned char *key,
+                                       const unsigned char *aad, int aad_len,
+                                       int *out_len);
+unsigned char *Crypto_DecryptAES256GCM(const unsigned char *sealed,
+                                       int sealed_len,
+                                       const unsigned char *key,
+                                       const unsigned char *aad, int aad_len,
+                                       int *out_len);
+
+// Caller-buffer variants of the above. They return the number of bytes
+// written to out, or -1 on failure (including out_cap being too small).
+// *SealedSize gives the exact encrypt output size up front; decrypt output is
+// at most the input size minus the IV/nonce (and tag).
+// In place: encrypt accepts plaintext == out + IV/nonce length, decrypt
+// accepts out == input + IV/nonce length.
+int Crypto_AES256SealedSize(int plaintext_len);
+int Crypto_AES256GCMSealedSize(int plaintext_len);
+int Crypto_EncryptAES256Into(const unsigned char *plaintext, int plaintext_len,
+                             const unsigned char *key, unsigned char *out,
+                             int out_cap);
+int Crypto_DecryptAES256Into(const unsigned char *ciphertext_with_iv,
+                             int ciphertext_len, const unsigned char *key,
+                             unsigned char *out, int out_cap);
+int Crypto_EncryptAES256GCMInto(const unsigned char *plaintext,
+                                int plaintext_len, const unsigned char *key,
+                                const unsigned char *aad, int aad_len,
+                                unsigned char *out, int out_cap);
+int Crypto_DecryptAES256GCMInto(const unsigned char *sealed, int sealed_len,
+                                const unsigned char *key,
+                                const unsigned char *aad, int aad_len,
+                                unsigned char *out, int out_cap);
+
+// Explicit-nonce AES-256-GCM for record layers that manage their own nonces.
+// Seal writes [ciphertext][tag]; Open takes the same and returns the
+// plaintext length, or -1 if the tag does not verify. In place if out == in.
+int Crypto_SealAES256GCM(const unsigned char *key, const unsigned char *nonce,
+                         const unsigned char *aad, int aad_len,
+                         const unsigned char *plaintext, int plaintext_len,
+                         unsigned char *out, int out_cap);
+int Crypto_OpenAES256GCM(const unsigned char *key, const unsigned char *nonce,
+                         const unsigned char *aad, int aad_len,
+                         const unsigned char *sealed, int sealed_len,
+                         unsigned char *out, int out_cap);
+
+// AEAD ciphers selectable for payloads and the transport, identified on the
+// wire by these ids. Both take a 32-byte key and a 12-byte nonce and append a
+// 16-byte tag, so the CRYPTO_GCM_* sizes and *GCMSealedSize apply to either.
+// The functions mirror the AES-256-GCM ones above.
+#define CRYPTO_CIPHER_AES256_GCM 1
+#define CRYPTO_CIPHER_CHACHA20_POLY1305 2
+bool Crypto_CipherSupported(int cipher);
+const char *Crypto_CipherName(int cipher);
+// The faster cipher on this host, measured once on first call
+int Crypto_PreferredCipher(void);
+int Crypto_AEADSeal(int cipher, const unsigned char *key,
+                    const unsigned char *nonce, const unsigned char *aad,
+                    int aad_len, const unsigned char *plaintext,
+                    int plaintext_len, unsigned char *out, int out_cap);
+int Crypto_AEADOpen(int cipher, const unsigned char *key,
+                    const unsigned char *nonce, const unsigned char *aad,
+                    int aad_len, const unsigned char *sealed, int sealed_len,
+                    unsigned char *out, int out_cap);
+int Crypto_EncryptAEADInto(int cipher, const unsigned char *plaintext,
+                           int plaintext_len, const unsigned char *key,
+                           const unsigned char *aad, int aad_len,
+                           unsigned char *out, int out_cap);
+int Crypto_DecryptAEADInto(int cipher, const unsigned char *sealed,
+                           int sealed_len, const unsigned char *key,
+                           const unsigned char *aad, int aad_len,
+                           unsigned char *out, int out_cap);
+
+// Batch AEAD over independent records (each with its own nonce), spread over
+// a worker pool when the batch holds at least CRYPTO_PARALLEL_MIN_BYTES.
+// Output is byte-identical to sealing the records one by one. Each job's
+// result is its Seal/Open return value; the call fails if any job failed.
+// Crypto_SetParallelism caps the threads used, caller included (0 = one per
+// online CPU, 1 = never parallel).
+#define CRYPTO_PARALLEL_MIN_BYTES (256 * 1024)
+typedef struct {
+  const unsigned char *nonce;
+  const unsigned char *aad;
+  int aad_len;
+  const unsigned char *in;
+  int in_len;
+  unsigned char *out;
+  int out_cap;
+  int result;
+} CryptoAEADJob;
+bool Crypto_AEADSealBatch(int cipher, const unsigned char *key,
+                          CryptoAEADJob *jobs, int count);
+bool Crypto_AEADOpenBatch(int cipher, const unsigned char *key,
+                          CryptoAEADJob *jobs, int count);
+void Crypto_SetParallelism(int threads);
+int Crypto_Parallelism(void);
+
+// PBKDF2-HMAC-SHA256 passphrase KDF. Derived keys are cached for the session
+// per (passphrase, salt, iterations). Crypto_SessionKey hands out the salt
+// this session seals new payloads with, deriving it only on first use.
+#define CRYPTO_KDF_PBKDF2_SHA256 1
+#define CRYPTO_KDF_SALT_LEN 16
+#define CRYPTO_KDF_ITERATIONS 600000
+#define CRYPTO_KDF_MIN_ITERATIONS 10000
+// Whoever wrote a hello or carrier picks its count and whoever opens it pays
+// for it on a receive thread, so neither may ask for more than we write
+// ourselves. Crypto_DeriveKey refuses anything above it.
+#define CRYPTO_KDF_MAX_ITERATIONS CRYPTO_KDF_ITERATIONS
+bool Crypto_DeriveKey(const char *passphrase, const unsigned char *salt,
+                      uint32_t iterations, unsigned char *key);
+bool Crypto_SessionKey(const char *passphrase, unsigned char *salt,
+                       uint32_t *iterations, unsigned char *key);
+void Crypto_ClearKeyCache(void);
+
+// HKDF-SHA256 (RFC 5869) for expanding a derived key into per-use subkeys
+bool Crypto_HKDF(const unsigned char *ikm, size_t ikm_len,
+                 const unsigned char *salt, size_t salt_len, const char *info,
+                 unsigned char *out, size_t out_len);
+
+// Fresh random bytes for nonces and salts
+bool Crypto_RandomBytes(unsigned char *buf, size_t len);
+
 void Crypto_XOR(unsigned char *data, size_t data_len, const unsigned char *key, size_t key_len);
 
+// CRC32 (IEEE) and CRC32C (Castagnoli). Backends (PCLMULQDQ, SSE4.2,
+// ARMv8 CRC or slicing-by-8) are picked at runtime on first use. The Update
+// variants take the previous result so a checksum can be built piecewise,
+// starting from 0.
 uint32_t Crypto_CRC32(const unsigned char *data, size_t length);
+uint32_t Crypto_CRC32Update(uint32_t crc, const unsigned char *data,
+                            size_t length);
+uint32_t Crypto_CRC32C(const unsigned char *data, size_t length);
+uint32_t Crypto_CRC32CUpdate(uint32_t crc, const unsigned char *data,
+                             size_t length);
+const char *Crypto_CRCBackend(bool castagnoli);
 
 #endif
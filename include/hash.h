@@ -0,0 +1,29 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Content hashing for transfer integrity and as cache/dedup keys. SHA-256 via
+// OpenSSL, which uses the SHA extensions (x86 SHA-NI, ARMv8 SHA2) when the CPU
+// has them. Hashes are computed incrementally so data can be hashed while it
+// streams.
+#define HASH_LEN 32
+#define HASH_HEX_LEN (HASH_LEN * 2)
+
+typedef struct HashCtx HashCtx;
+
+HashCtx *Hash_Begin(void);
+void Hash_Update(HashCtx *ctx, const void *data, size_t len);
+// Writes the digest and frees the context. Pass NULL out to just discard it.
+bool Hash_End(HashCtx *ctx, unsigned char *out);
+
+bool Hash_Buffer(const void *data, size_t len, unsigned char *out);
+bool Hash_File(const char *path, unsigned char *out);
+
+// Lower-case hex with NUL, for use as a string key (HASH_HEX_LEN + 1 bytes)
+void Hash_ToHex(const unsigned char *hash, char *hex);
+bool Hash_Equal(const unsigned char *a, const unsigned char *b);
+const char *Hash_Name(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Latency histogram in nanoseconds, bucketed like HdrHistogram: values below
+// 2^HISTOGRAM_SUB_BITS are exact, and every power of two above that is split
+// into 2^HISTOGRAM_SUB_BITS linear buckets, so a percentile is off by at most
+// 1/32 (about 3%) anywhere in the range. Values past ~68 s land in the top
+// bucket.
+//
+// Lock-free: one thread records (the receive thread) while any other reads,
+// with relaxed atomic counters only. A reader racing a record may see the
+// count and the buckets one sample apart, which a percentile shrugs off.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS                                                      \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+  atomic_uint buckets[HISTOGRAM_BUCKETS];
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t maxNs;
+} Histogram;
+
+// A record racing the reset may or may not survive it
+void Histogram_Reset(Histogram *h);
+void Histogram_Record(Histogram *h, uint64_t ns);
+uint64_t Histogram_Count(const Histogram *h);
+uint64_t Histogram_Max(const Histogram *h);
+// Smallest value at or above which (1 - q) of the samples lie, e.g. q = 0.99
+// for p99; 0 when empty. Never more than the largest value recorded.
+uint64_t Histogram_Percentile(const Histogram *h, double q);
+
+#endif
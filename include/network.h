@@ -2,13 +2,45 @@
 #define NETWORK_H
 
 #include "common.h"
+#include "sendqueue.h"
 
+// Listens for or connects to a peer and starts the connection threads,
+// blocking until done or timed out. A server takes the first peer only.
 void InitializeConnection(AppState *state, bool asServer, const char *ip,
                           int port);
+// Same, on a background thread so the caller (the UI) never blocks; progress
+// shows in connection.connectPhase and the status line. A server goes on
+// accepting peers, up to MAX_CLIENTS at a time, until CloseConnection; a
+// client with autoReconnect set redials a dropped link until then.
+void StartConnection(AppState *state, bool asServer, const char *ip,
+                     int port);
+// Ends the connection with every peer, or cancels an attempt still in
+// progress
 void CloseConnection(AppState *state);
+// Both go to every connected peer; a server also passes on the text it
+// receives to its other peers. With an outbox, text stays in it until a
+// link's writer has sent it, so a line a dropped link never wrote goes out
+// again on the next.
 void SendMessage(AppState *state, const char *message, MessageType type);
 void SendFile(AppState *state, const char *filepath, MessageType type);
 void *ReceiveMessages(void *arg);
+// Outbound queue depth summed over peers and latency of the slowest; false
+// when not connected
+bool GetSendQueueStats(AppState *state, SendQueueStats *out);
+
+typedef struct {
+  uint64_t pings; // Sent on the current links
+  uint64_t pongs; // Answered, and timed
+  double p50Ms;
+  double p99Ms;
+  double maxMs;
+} RttStats;
+
+// Ping round trips of the peer with the worst p99 (pings and pongs are
+// totals over peers); false until some peer has answered a ping
+bool GetRttStats(AppState *state, RttStats *out);
+// Starts the round trip figures afresh, e.g. between benchmark phases
+void ResetRttStats(AppState *state);
 
 #endif
 
@@ -0,0 +1,66 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Chat lines, kept on disk from the moment they are typed until a link's
+// writer thread has put them on the wire. The file is an append-only log of
+// records
+//   [Kind: 1] [ID: 8] [Length: 4] [Text]
+// Kind 'Q' queues a line and kind 'S' (no text) marks the line with that ID
+// sent. A thread of the outbox's own writes and fdatasyncs the records, so
+// neither the UI nor a writer thread waits on the disk. Opening the file
+// replays the log, so lines queued before a crash or restart are still
+// pending; one that went out before its 'S' record landed goes out again with
+// the same ID, which receivers drop as a duplicate. A torn record at the end
+// is cut off, and the file is emptied whenever nothing is pending.
+#define OUTBOX_MAX_PENDING 256
+
+typedef struct {
+  uint64_t id;
+  char *text;
+} OutboxEntry;
+
+typedef struct Outbox {
+  int fd;
+  // Held across a whole replay by the caller, so lines written meanwhile
+  // queue up behind it instead of overtaking it
+  pthread_mutex_t lock;
+  OutboxEntry pending[OUTBOX_MAX_PENDING]; // Oldest first
+  int count;
+  // The first queued pending lines are on the current links' send queues;
+  // the rest wait for the next link
+  int queued;
+
+  // The journal thread's side, under journalLock, which is taken after lock
+  // and never held while waiting for anything else
+  pthread_mutex_t journalLock;
+  pthread_cond_t journalWake;
+  pthread_t journalThread;
+  unsigned char *journal; // Records not yet written
+  size_t journalLen, journalCap;
+  bool truncate;     // Empty the file before writing the journal
+  uint64_t *written; // IDs writer threads have sent, not yet dropped
+  size_t writtenCount, writtenCap;
+  bool stopping;
+} Outbox;
+
+// Opens or creates the outbox at path; NULL if it cannot be read or written
+Outbox *Outbox_Open(const char *path);
+// Writes out what is left of the journal. No link may be up any more.
+void Outbox_Close(Outbox *o);
+// Lines waiting to go out; takes the lock itself, e.g. for the UI
+int Outbox_Pending(Outbox *o);
+// Drops the line with this ID, if it is pending, now that a writer thread has
+// sent it. Takes only journalLock, so a writer may call it whatever locks
+// other threads hold while they wait for it.
+void Outbox_MarkSent(Outbox *o, uint64_t id);
+
+// Called with o->lock held: queues a line and journals it. False if the
+// outbox is full or out of memory; a record the disk refuses is logged.
+bool Outbox_Append(Outbox *o, uint64_t id, const char *text);
+
+#endif
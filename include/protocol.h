@@ -0,0 +1,40 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// What goes over the wire, shared by the app and the relay daemon (which
+// must build without raylib). A frame is
+//   [Length: 4, big-endian] [Type: 1] [Payload] [CRC32C: 4, if flagged]
+// where Length counts everything after itself.
+
+#define PORT 8888
+#define MAX_FRAME_BYTES (15 * 1024 * 1024)
+
+typedef enum {
+  MSG_TEXT,
+  MSG_IMAGE,
+  MSG_AUDIO,
+  MSG_FILE_CHUNK,
+  MSG_FILE_END,
+  MSG_PING,
+  MSG_PONG,
+  MSG_HELLO,
+  MSG_FILE_REJECT, // Receiver refuses a transfer
+  MSG_FILE_RESUME, // Receiver asks for a transfer from an offset
+  MSG_FILE_BEGIN   // Sender announces a transfer
+} MessageType;
+
+// Set on the frame type byte when the frame carries a 4-byte CRC32C trailer
+// covering the type byte and payload.
+#define FRAME_FLAG_CRC 0x80
+
+// MSG_PING carries [Sequence: 8] [Sent at: 8, the sender's monotonic clock in
+// ns], both big-endian, and MSG_PONG echoes the ping's payload unchanged, so
+// the sender times the round trip against its own clock alone.
+#define PING_PAYLOAD_LEN 16
+
+// MSG_TEXT carries [Length: 4] [Text] [ID: 8], big-endian. The ID is random
+// per line and stays with it when a line is sent again after a reconnect, so
+// receivers show it once; older peers send no ID and ignore it.
+#define TEXT_ID_LEN 8
+
+#endif
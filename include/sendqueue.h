@@ -0,0 +1,125 @@
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Outbound frames waiting for the connection's writer thread. Any thread may
+// push; only the writer pops. Pushing is a single atomic exchange plus a
+// sem_post, so the UI and receive threads never block on the socket.
+// (Intrusive MPSC lists after Vyukov, with a stub node.)
+//
+// Each priority class has its own list and the writer always takes from the
+// most urgent non-empty one, so a ping or a chat line never waits behind
+// queued bulk data.
+#define SENDQUEUE_MAX_PARTS 8
+
+typedef enum {
+  SEND_PRIO_CONTROL, // Hello, ping, pong
+  SEND_PRIO_TEXT,
+  SEND_PRIO_BULK, // File transfers
+  SEND_PRIO_COUNT
+} SendPriority;
+
+// A buffer many queues send without copying it, e.g. one message going to
+// every peer. Freed when the last reference goes.
+typedef struct SendShared {
+  atomic_int refs;
+  size_t len;
+  unsigned char *data; // Right after the struct, or a buffer it took over
+} SendShared;
+
+typedef struct SendFrame {
+  _Atomic(struct SendFrame *) next;
+  int type;
+  SendPriority priority;
+  struct iovec parts[SENDQUEUE_MAX_PARTS];
+  int count;
+  void *owned; // Heap buffer handed over by the producer, freed with the frame
+  // Body streamed after the frame by the writer: either a file (fd, closed
+  // with the frame) or a heap buffer (freed with it). fd is -1 and body NULL
+  // for plain frames.
+  int fd;
+  unsigned char *body;
+  uint64_t bodyLen;
+  SendShared *shared; // Holds a part or the body; released with the frame
+  uint64_t enqueuedNs;
+  unsigned char copies[]; // Copies of the parts the producer did not hand over
+} SendFrame;
+
+typedef struct {
+  size_t depth;      // Frames queued and not yet written
+  uint64_t sent;     // Frames written since the queue was created
+  double lastMs;     // Enqueue-to-written time of the latest frame
+  double avgMs;      // Moving average of the same
+  double maxMs;
+} SendQueueStats;
+
+typedef struct {
+  _Atomic(SendFrame *) head; // Producers swap themselves in here
+  SendFrame *tail;           // Consumer side
+  SendFrame stub;
+  atomic_size_t depth;
+} SendLane;
+
+typedef struct SendQueue {
+  SendLane lanes[SEND_PRIO_COUNT];
+  sem_t ready; // Posted once per push and on close
+  atomic_bool closed;
+  atomic_uint_fast64_t sent;
+  atomic_uint_fast64_t lastNs;
+  atomic_uint_fast64_t avgNs;
+  atomic_uint_fast64_t maxNs;
+} SendQueue;
+
+// Returns a buffer of len bytes holding one reference, or NULL
+SendShared *SendShared_Create(size_t len);
+// Same, around a malloc'd buffer it takes over, and frees on failure
+SendShared *SendShared_Adopt(void *data, size_t len);
+void SendShared_Release(SendShared *shared);
+
+SendQueue *SendQueue_Create(void);
+// Frees any frames still queued. The writer must have stopped.
+void SendQueue_Destroy(SendQueue *q);
+
+// Queues a frame made of parts. Parts are copied, except parts[ownedPart]
+// (-1 for none), a malloc'd buffer that the queue takes over and frees once
+// written, even if the push fails. Fails only when out of memory or closed.
+bool SendQueue_Push(SendQueue *q, SendPriority priority, int type,
+                    const struct iovec *parts, int count, int ownedPart);
+// Queues a frame followed by fileLen bytes of fd, which the queue takes over
+// and closes once written, even if the push fails. How the file is framed is
+// up to the writer.
+bool SendQueue_PushFile(SendQueue *q, SendPriority priority, int type,
+                        const struct iovec *parts, int count, int fd,
+                        uint64_t fileLen);
+// Same, but the body is a malloc'd buffer the queue takes over and frees
+bool SendQueue_PushBody(SendQueue *q, SendPriority priority, int type,
+                        const struct iovec *parts, int count, void *body,
+                        uint64_t bodyLen);
+// Queues a frame whose parts[sharedPart] lies in shared, or with sharedPart
+// -1, that streams all of shared after it as its body. The frame takes its own
+// reference, so the caller keeps (and eventually releases) theirs.
+bool SendQueue_PushShared(SendQueue *q, SendPriority priority, int type,
+                          const struct iovec *parts, int count, int sharedPart,
+                          SendShared *shared);
+// Writer side: takes the oldest frame of the most urgent class up to
+// maxPriority. With wait it blocks until there is one; either way it returns
+// NULL once the queue closes.
+SendFrame *SendQueue_Pop(SendQueue *q, SendPriority maxPriority, bool wait);
+// Writer side: records the frame's latency and frees it
+void SendQueue_Done(SendQueue *q, SendFrame *frame);
+// Frees a frame without counting it as sent, e.g. one kept from a queue that
+// is gone
+void SendQueue_Drop(SendFrame *frame);
+// Wakes the writer and makes Pop return NULL; pending frames are dropped
+void SendQueue_Close(SendQueue *q);
+bool SendQueue_Closed(SendQueue *q);
+
+void SendQueue_Stats(SendQueue *q, SendQueueStats *out);
+
+#endif
@@ -3,6 +3,9 @@
 
 #include "common.h"
 
+// Longest message a decoder can return (legacy STG1 plaintext payloads)
+#define STEGO_MAX_MESSAGE_LEN (MAX_MESSAGE_LENGTH * 2)
+
 void EncodeMessageInImage(AppState *state, const char *imagePath,
                           const char *message, const char *outputPath);
 char *DecodeMessageFromImage(AppState *state, const char *imagePath);
@@ -10,4 +13,20 @@ void EncodeMessageInAudio(AppState *state, const char *audioPath,
                           const char *message, const char *outputPath);
 char *DecodeMessageFromAudio(AppState *state, const char *audioPath);
 
+// Encode into a file image in memory (PNG or 16-bit PCM WAV) instead of
+// writing outputPath. Returns a buffer to release with free(), or NULL.
+unsigned char *EncodeMessageInImageToMemory(AppState *state,
+                                            const char *imagePath,
+                                            const char *message, size_t *size);
+unsigned char *EncodeMessageInAudioToMemory(AppState *state,
+                                            const char *audioPath,
+                                            const char *message, size_t *size);
+
+// Decode into a caller buffer instead of returning a malloc'd string; false if
+// there is no readable message or it does not fit in outSize (including NUL).
+bool DecodeMessageFromImageInto(AppState *state, const char *imagePath,
+                                char *out, size_t outSize);
+bool DecodeMessageFromAudioInto(AppState *state, const char *audioPath,
+                                char *out, size_t outSize);
+
 #endif
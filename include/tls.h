@@ -0,0 +1,44 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+
+struct ssl_st;
+
+// Optional TLS 1.3 around a connected socket, negotiated before the transport
+// hello. Kernel TLS is requested, so once the handshake finishes the kernel
+// does the record encryption and sendfile() stays zero-copy; when the kernel
+// lacks the "tls" ULP, OpenSSL keeps the records in user space.
+//
+// The server presents certPath/keyPath, or a throwaway self-signed P-256
+// certificate if those files are missing. The client verifies the peer
+// against caPath (the server's own certificate can serve as its CA, which
+// pins it) and checks that the certificate names the host or IP it dialed.
+// Without a readable caPath it refuses to connect, unless insecure is set,
+// which only encrypts and authenticates nobody.
+//
+// Clients keep the last session ticket per host:port, and the server keeps
+// its ticket keys for the life of the process, so reconnects resume without
+// a full handshake.
+typedef struct {
+  const char *certPath;
+  const char *keyPath;
+  const char *caPath;
+  bool insecure;
+} TlsConfig;
+
+// Both handshake on a non-blocking socket and return NULL on failure, on
+// timeout or once cancelFd (-1 for none) becomes readable, leaving the socket
+// open
+struct ssl_st *Tls_Accept(int fd, const TlsConfig *config, int cancelFd);
+struct ssl_st *Tls_Connect(int fd, const char *host, int port,
+                           const TlsConfig *config, int cancelFd);
+
+bool Tls_KernelSend(struct ssl_st *ssl);
+bool Tls_KernelRecv(struct ssl_st *ssl);
+bool Tls_Resumed(struct ssl_st *ssl);
+const char *Tls_CipherName(struct ssl_st *ssl);
+
+void Tls_Cleanup(void);
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ssl_st;
+struct Uring;
+
+// Byte-stream layer between the frame codec and the socket. In cleartext mode
+// it passes bytes straight through. Once a direction is encrypted its stream
+// becomes a sequence of AEAD records (AES-256-GCM or ChaCha20-Poly1305, as
+// negotiated):
+//
+//   [Length: 4 bytes] [ciphertext] [Tag: 16 bytes]
+//
+// Length counts ciphertext bytes (at most TRANSPORT_RECORD_MAX) and is bound
+// as AAD. The nonce is the record's 64-bit sequence number and each direction
+// has its own key, HKDF(sender's passphrase key, sender's hello nonce ||
+// receiver's hello nonce). The receiver's fresh nonce ties the key to this
+// link, so records cannot be replayed from another session, reordered or
+// reflected. Frames of any size stream through fixed record buffers.
+//
+// Each side opens with a cleartext MSG_HELLO, the first and only one on the
+// link, whose payload is
+//   [Version: 1] [Flags: 1] [KDF: 1] [Iterations: 4] [Salt: 16] [Nonce: 16]
+//   [Preferred cipher: 1] [Supported ciphers: 1]
+// and, if it set TRANSPORT_HELLO_ENCRYPTED, encrypts everything after it. A
+// side that encrypts refuses a peer that does not, and the iterations a peer
+// asks for are capped at CRYPTO_KDF_MAX_ITERATIONS.
+// The cipher is negotiated from both hellos, so an encrypting side holds its
+// first frame until the peer's hello arrives. Both directions use
+// ChaCha20-Poly1305 if both support it and either side prefers it (it only
+// does when AES is slow there), and AES-256-GCM otherwise. Supported ciphers
+// is a bitmask of (1 << CRYPTO_CIPHER_*); hellos without the cipher bytes
+// mean AES-256-GCM only.
+
+#define TRANSPORT_RECORD_MAX 16384
+// Large sends and receives seal/open this many records per batch, spread
+// over the crypto worker pool
+#define TRANSPORT_BATCH_RECORDS 16
+// Most pieces Transport_SendV accepts for one call
+#define TRANSPORT_MAX_IOV 16
+// A plain socket is read this much at a time, so a burst of small frames or
+// records costs one recv(2)
+#define TRANSPORT_READAHEAD (256 * 1024)
+#define TRANSPORT_HELLO_LEN 41
+#define TRANSPORT_HELLO_MIN_LEN 39
+#define TRANSPORT_HELLO_VERSION 2
+#define TRANSPORT_HELLO_ENCRYPTED 0x01
+
+typedef enum {
+  TRANSPORT_OK,
+  TRANSPORT_TIMEOUT, // Wait cut short before any byte was consumed
+  TRANSPORT_CLOSED,  // Orderly shutdown by the peer, or Transport_Close
+  TRANSPORT_ERROR,   // Socket error
+  TRANSPORT_BAD_RECORD
+} TransportStatus;
+
+typedef struct {
+  bool encrypted;
+  int cipher;
+  unsigned char key[32];
+  uint64_t seq;
+  unsigned char *plain; // Staged plaintext (tx) or opened record (rx)
+  size_t plainLen;
+  size_t plainPos;
+  unsigned char *record; // Sealed record: length prefix + ciphertext + tag
+  unsigned char *batch;  // Room for TRANSPORT_BATCH_RECORDS sealed records
+} TransportDirection;
+
+typedef struct Transport {
+  int fd;
+  struct ssl_st *ssl; // TLS session, owned; NULL for a plain socket
+  pthread_mutex_t sslLock;
+  pthread_mutex_t txLock;
+  pthread_cond_t txReadyCond;
+  TransportDirection tx;
+  TransportDirection rx;
+  bool txArmed;   // tx key derived; encrypt once the cipher is negotiated
+  bool helloSeen; // The peer's hello was accepted; no other is
+  unsigned char txBase[32];     // Our passphrase key, until the peer's nonce
+  unsigned char localNonce[16]; // As sent in our hello
+  bool txReady;   // Frames may be sent
+  bool closed;    // Transport_Close was called; senders stop waiting
+  int localCipher; // Our preferred cipher, as sent in the hello
+  int wakeFd; // eventfd signalled by Transport_Close to end a blocked receive
+  int pollFd; // epoll set of fd and wakeFd that receives wait on
+  struct Uring *ring; // Receive thread's io_uring, read instead when set
+  unsigned char *in; // Socket read-ahead; bytes inPos..inLen are unread
+  size_t inPos;
+  size_t inLen;
+} Transport;
+
+Transport *Transport_Create(int fd);
+void Transport_Destroy(Transport *t);
+
+// Builds this side's hello. With a passphrase, derives the tx key and arms
+// encryption. Transport_StartTx is called once the hello is sent; from then
+// on an armed transport holds frames until the peer's hello is accepted.
+bool Transport_MakeHello(Transport *t, const char *passphrase,
+                         unsigned char *hello);
+void Transport_StartTx(Transport *t);
+// Applies the peer's hello and negotiates the cipher. Fails on a second
+// hello, if the peer encrypts and no passphrase is given, if we encrypt and
+// the peer does not, or if the key cannot be derived.
+bool Transport_AcceptHello(Transport *t, const char *passphrase,
+                           const unsigned char *hello, size_t len);
+// Routes all I/O through an established TLS session (see tls.h), which then
+// replaces the record layer
+void Transport_AttachTLS(Transport *t, struct ssl_st *ssl);
+// Has the receive thread read the socket through ring (see uring.h) instead
+// of recv(2) and epoll; NULL goes back. Not for TLS, whose reads OpenSSL
+// makes itself.
+bool Transport_UseRing(Transport *t, struct Uring *ring);
+bool Transport_IsEncrypted(const Transport *t);
+// Whether Transport_SendFile moves file data without copying it through user
+// space: a cleartext socket, or TLS offloaded to the kernel
+bool Transport_ZeroCopy(const Transport *t);
+// CRYPTO_CIPHER_* id our frames are sealed with, or 0 for cleartext
+int Transport_Cipher(const Transport *t);
+// Releases senders still waiting on the handshake, wakes a blocked receive
+// and ends a TLS session
+void Transport_Close(Transport *t);
+
+// A frame is sent as BeginSend, any number of Send calls, EndSend. The tx lock
+// is held throughout so frames from different threads never interleave, and
+// EndSend flushes the final partial record. BeginSend fails, without holding
+// the lock, if the handshake does not finish in time or the transport closes.
+bool Transport_BeginSend(Transport *t);
+bool Transport_Send(Transport *t, const void *data, size_t len);
+// Sends the pieces in order. A cleartext socket gets them in one sendmsg(2);
+// records and TLS coalesce small pieces before sealing or writing.
+bool Transport_SendV(Transport *t, const struct iovec *iov, int iovcnt);
+bool Transport_EndSend(Transport *t);
+// Sends len bytes of fileFd starting at offset as part of the current frame:
+// sendfile(2) or SSL_sendfile(3) when zero-copy, read and Send otherwise. A
+// file that ends first (truncated meanwhile) is sent up to its end, *sent
+// telling how far that is, and the caller finishes the frame.
+bool Transport_SendFile(Transport *t, int fileFd, off_t offset, size_t len,
+                        size_t *sent);
+
+// Receives exactly len bytes, sleeping in epoll while there are none. With
+// allowTimeout, a wait cut short by a signal before the first byte returns
+// TRANSPORT_TIMEOUT; otherwise it keeps waiting. Transport_Close from another
+// thread ends any wait at once with TRANSPORT_CLOSED.
+TransportStatus Transport_Recv(Transport *t, void *buf, size_t len,
+                               bool allowTimeout);
+// Same, but points *data at the bytes where the transport already holds them
+// in one piece (read ahead, or in an opened record) and only copies them into
+// scratch, which has room for len, otherwise. *data is good until the next
+// receive. A timeout here never consumes anything.
+TransportStatus Transport_RecvView(Transport *t, void *scratch, size_t len,
+                                   bool allowTimeout,
+                                   const unsigned char **data);
+
+#endif
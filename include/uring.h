@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A receive thread's io_uring, driven through the raw system calls (no
+// liburing). It carries two streams of work:
+//
+// - The socket is read by one multishot receive into a ring of provided
+//   buffers registered with the kernel, so while data keeps coming each read
+//   is a completion picked off shared memory rather than a recv(2), and an
+//   idle wait is one io_uring_enter(2) instead of epoll_wait plus recv.
+// - Received file data is copied into registered (fixed) buffers, coalesced
+//   and written behind with WRITE_FIXED while the thread goes on reading.
+//
+// Needs Linux 6.0 or later for multishot receive; Uring_Create probes for it
+// once and fails on older kernels, and callers fall back to recv(2) and
+// stdio. Single-threaded: only the owning thread may call in.
+#define URING_ENTRIES 64
+#define URING_RECV_BUFS 16 // A power of two, as the buffer ring needs
+#define URING_RECV_BUF_SIZE (32 * 1024)
+#define URING_WRITE_BUFS 4
+#define URING_WRITE_BUF_SIZE (128 * 1024)
+
+typedef struct Uring Uring;
+
+// NULL if the kernel lacks io_uring, multishot receive or room to register
+// the buffers
+Uring *Uring_Create(void);
+// Cancels whatever is in flight and waits for it, so the buffers can go
+void Uring_Destroy(Uring *r);
+
+// Starts receiving from fd. A readable wakeFd (an eventfd, or -1 for none)
+// ends waits in Uring_Recv.
+bool Uring_Watch(Uring *r, int fd, int wakeFd);
+// Like recv(2): copies up to len bytes already received into buf, waiting
+// for some if there are none. Returns 0 once the peer has shut down, or -1
+// with errno set: EINTR for a wait cut short by a signal, ECANCELED once
+// wakeFd is readable, or the socket's error.
+ssize_t Uring_Recv(Uring *r, void *buf, size_t len);
+
+// Queues len bytes for fd at offset; they are copied, so data may be reused
+// at once. Consecutive writes to the same file are merged. False once a write
+// has failed since the last drain.
+bool Uring_Write(Uring *r, int fd, uint64_t offset, const void *data,
+                 size_t len);
+// Waits for every queued write to land. False if any failed or came up short;
+// either way the next write starts clean.
+bool Uring_Drain(Uring *r);
+
+#endif
@@ -0,0 +1,37 @@
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+// Size class for len, or -1 when it is too large to pool
+static int ClassOf(size_t len) {
+  int c = 0;
+  while (c < BUFPOOL_CLASSES && ((size_t)1 << (BUFPOOL_MIN_SHIFT + c)) < len)
+    c++;
+  return c < BUFPOOL_CLASSES ? c : -1;
+}
+
+void *BufPool_Get(BufPool *pool, size_t len) {
+  int c = ClassOf(len);
+  if (c < 0)
+    return malloc(len);
+  if (pool->count[c] > 0)
+    return pool->free[c][--pool->count[c]];
+  return malloc((size_t)1 << (BUFPOOL_MIN_SHIFT + c));
+}
+
+void BufPool_Put(BufPool *pool, void *buf, size_t len) {
+  int c = ClassOf(len);
+  if (!buf)
+    return;
+  if (c < 0 || pool->count[c] == BUFPOOL_DEPTH) {
+    free(buf);
+    return;
+  }
+  pool->free[c][pool->count[c]++] = buf;
+}
+
+void BufPool_Clear(BufPool *pool) {
+  for (int c = 0; c < BUFPOOL_CLASSES; c++)
+    while (pool->count[c] > 0)
+      free(pool->free[c][--pool->count[c]]);
+}
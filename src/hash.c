@@ -0,0 +1,100 @@
+#include "hash.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HASH_FILE_CHUNK (64 * 1024)
+
+// Fetched once; passing EVP_sha256() re-resolves the provider on every call,
+// which dominates hashing short inputs
+static EVP_MD *sha256_md = NULL;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void Hash_FetchMD(void) {
+  sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+}
+
+static const EVP_MD *Hash_MD(void) {
+  pthread_once(&sha256_once, Hash_FetchMD);
+  return sha256_md ? sha256_md : EVP_sha256();
+}
+
+struct HashCtx {
+  EVP_MD_CTX *md;
+};
+
+HashCtx *Hash_Begin(void) {
+  HashCtx *ctx = malloc(sizeof(HashCtx));
+  if (!ctx)
+    return NULL;
+  ctx->md = EVP_MD_CTX_new();
+  if (!ctx->md || 1 != EVP_DigestInit_ex(ctx->md, Hash_MD(), NULL)) {
+    EVP_MD_CTX_free(ctx->md);
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void Hash_Update(HashCtx *ctx, const void *data, size_t len) {
+  if (ctx && len > 0)
+    EVP_DigestUpdate(ctx->md, data, len);
+}
+
+bool Hash_End(HashCtx *ctx, unsigned char *out) {
+  if (!ctx)
+    return false;
+  bool ok = true;
+  if (out) {
+    unsigned int len = 0;
+    ok = EVP_DigestFinal_ex(ctx->md, out, &len) == 1 && len == HASH_LEN;
+  }
+  EVP_MD_CTX_free(ctx->md);
+  free(ctx);
+  return ok;
+}
+
+bool Hash_Buffer(const void *data, size_t len, unsigned char *out) {
+  unsigned int outLen = 0;
+  return EVP_Digest(data, len, out, &outLen, Hash_MD(), NULL) == 1 &&
+         outLen == HASH_LEN;
+}
+
+bool Hash_File(const char *path, unsigned char *out) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+  HashCtx *ctx = Hash_Begin();
+  unsigned char *chunk = malloc(HASH_FILE_CHUNK);
+  if (!ctx || !chunk) {
+    Hash_End(ctx, NULL);
+    free(chunk);
+    fclose(file);
+    return false;
+  }
+
+  size_t n;
+  while ((n = fread(chunk, 1, HASH_FILE_CHUNK, file)) > 0)
+    Hash_Update(ctx, chunk, n);
+  bool ok = !ferror(file);
+  fclose(file);
+  free(chunk);
+  return Hash_End(ctx, ok ? out : NULL) && ok;
+}
+
+void Hash_ToHex(const unsigned char *hash, char *hex) {
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < HASH_LEN; i++) {
+    hex[i * 2] = digits[hash[i] >> 4];
+    hex[i * 2 + 1] = digits[hash[i] & 0x0F];
+  }
+  hex[HASH_HEX_LEN] = '\0';
+}
+
+bool Hash_Equal(const unsigned char *a, const unsigned char *b) {
+  return CRYPTO_memcmp(a, b, HASH_LEN) == 0;
+}
+
+const char *Hash_Name(void) { return "SHA-256"; }
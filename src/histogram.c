@@ -0,0 +1,72 @@
+#include <math.h>
+
+#include "histogram.h"
+
+#define SUB_COUNT (1u << HISTOGRAM_SUB_BITS)
+
+static unsigned BucketOf(uint64_t ns) {
+  if (ns < SUB_COUNT)
+    return (unsigned)ns;
+  if (ns >> HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_BUCKETS - 1;
+  // The top bit picks the power of two, the next SUB_BITS the linear step
+  unsigned top = 63 - __builtin_clzll(ns);
+  unsigned shift = top - HISTOGRAM_SUB_BITS;
+  unsigned sub = (unsigned)(ns >> shift) - SUB_COUNT;
+  return (shift + 1) * SUB_COUNT + sub;
+}
+
+// Largest value that falls in bucket i
+static uint64_t BucketTop(unsigned i) {
+  if (i < SUB_COUNT)
+    return i;
+  unsigned shift = i / SUB_COUNT - 1;
+  uint64_t low = (uint64_t)(SUB_COUNT + i % SUB_COUNT) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+void Histogram_Reset(Histogram *h) {
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+    atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+  atomic_store(&h->count, 0);
+  atomic_store(&h->maxNs, 0);
+}
+
+void Histogram_Record(Histogram *h, uint64_t ns) {
+  atomic_fetch_add_explicit(&h->buckets[BucketOf(ns)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&h->maxNs, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(
+                         &h->maxNs, &max, ns, memory_order_relaxed,
+                         memory_order_relaxed))
+    ;
+}
+
+uint64_t Histogram_Count(const Histogram *h) {
+  return atomic_load_explicit(&h->count, memory_order_relaxed);
+}
+
+uint64_t Histogram_Max(const Histogram *h) {
+  return atomic_load_explicit(&h->maxNs, memory_order_relaxed);
+}
+
+uint64_t Histogram_Percentile(const Histogram *h, double q) {
+  uint64_t count = Histogram_Count(h);
+  if (count == 0)
+    return 0;
+  uint64_t rank = (uint64_t)ceil(q * (double)count);
+  if (rank < 1)
+    rank = 1;
+  uint64_t max = Histogram_Max(h);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t top = BucketTop(i);
+      return top < max ? top : max;
+    }
+  }
+  // Buckets read ahead of the count of a record in progress
+  return max;
+}
@@ -1,8 +1,11 @@
 #include "common.h"
 #include "logging.h"
 #include "network.h"
+#include "outbox.h"
+#include "tls.h"
 #include "ui.h"
 #include "utils.h"
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -12,6 +15,9 @@
 int main(void) {
   Logger_Init("steganet.log");
   SetTraceLogLevel(LOG_WARNING);
+  // A peer vanishing mid-write must fail the write, not kill the app; TLS
+  // writes go through OpenSSL and cannot pass MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
 
   AppState appState = {0};
   AppState *state = &appState;
@@ -21,6 +27,21 @@ int main(void) {
   state->showConnectionDialog = true;
   strcpy(state->ytUrlBuffer, "https://www.youtube.com/");
   state->messageMutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+  state->connection.peerMutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+  state->frameChecksum = true;
+  state->encryptTransport = true;
+  state->connectTimeoutMs = 5000;
+  state->acceptTimeoutMs = 0; // Listen until cancelled
+  state->useUring = true;
+  state->tuning.noDelay = true;
+  state->tuning.corkBulk = true;
+  state->autoReconnect = true;
+  state->outbox = Outbox_Open("steganet.outbox");
+  strcpy(state->tlsCertPath, "steganet.crt");
+  strcpy(state->tlsKeyPath, "steganet.key");
+  // The server's certificate (or the CA that signed it), handed over out of
+  // band; never our own certificate by default
+  strcpy(state->tlsCAPath, "steganet-ca.crt");
 
   SetConfigFlags(FLAG_MSAA_4X_HINT | FLAG_VSYNC_HINT);
   InitWindow(800, 600, "StegaChat - Secure Messaging with Steganography");
@@ -64,8 +85,9 @@ int main(void) {
         shouldSend = true;
     }
 
+    // Text written offline waits in the outbox for the next link
     if (shouldSend && !state->showConnectionDialog &&
-        state->connection.isConnected) {
+        (state->connection.isConnected || state->outbox)) {
       if (state->selectedMessageType == MSG_TEXT &&
           strlen(state->inputBuffer) > 0) {
         SendMessage(state, state->inputBuffer, MSG_TEXT);
@@ -102,6 +124,8 @@ int main(void) {
                  state->connection.isConnected) {
         CloseConnection(state);
         state->showConnectionDialog = true;
+      } else if (state->connection.connectPhase != CONNECT_IDLE) {
+        CloseConnection(state);
       }
     }
 
@@ -127,7 +151,10 @@ int main(void) {
   }
 
   CloseConnection(state);
+  Outbox_Close(state->outbox);
+  Tls_Cleanup();
   pthread_mutex_destroy(&state->messageMutex);
+  pthread_mutex_destroy(&state->connection.peerMutex);
   if (state->imageLoaded)
     UnloadTexture(state->currentImageTexture);
   if (IsAudioDeviceReady())
@@ -1,206 +1,1331 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bufpool.h"
 #include "common.h"
+#include "crypto.h"
+#include "hash.h"
+#include "logging.h"
 #include "network.h"
+#include "outbox.h"
+#include "sendqueue.h"
 #include "steganography.h"
+#include "tls.h"
+#include "transport.h"
+#include "uring.h"
 #include "utils.h"
 
-// Helper to send exactly N bytes
-static bool SendAll(int socket, const unsigned char *buf, size_t len) {
-  size_t total = 0;
-  while (total < len) {
-    ssize_t n = send(socket, buf + total, len - total, 0);
-    if (n <= 0)
-      return false;
-    total += n;
+// File data goes out in MSG_FILE_CHUNK slices of this size so control and
+// text frames can be sent between them. With the 5-byte frame header, 8-byte
+// offset and 4-byte CRC a slice still fills whole transport records.
+#define BULK_SLICE_BYTES (4 * TRANSPORT_RECORD_MAX - 24)
+// Rewinds a transfer may take, over all its connections, before it is given
+// up on as a peer that cannot take the file
+#define BULK_MAX_REWINDS 64
+// Transfers kept waiting for the peer's word after their MSG_FILE_END; past
+// this the oldest is forgotten
+#define BULK_MAX_UNACKED 16
+// Unsent bytes the kernel may hold for us. Keeps the backlog behind which an
+// urgent frame lands to a fraction of a second, however large SO_SNDBUF is.
+#define SEND_LOWAT_BYTES (128 * 1024)
+
+// Notes from the receive thread to the writer about our outgoing transfers.
+// They travel the send queue so the writer has a single inbox, and use types
+// no wire frame can have.
+#define NOTE_FILE_RESUME 0x100 // [ID: 8] [Offset: 8], as sent by the peer
+#define NOTE_FILE_REJECT 0x101 // [ID: 8], or empty for the current transfer
+
+static void PutBE64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+static uint64_t GetBE64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t MonotonicNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Fills in the 5-byte frame header and returns whether a CRC32C trailer over
+// type + payload follows the payload
+static bool FrameHeader(Peer *peer, MessageType type, size_t payloadLen,
+                        unsigned char *header) {
+  // GCM records already authenticate every byte. File data always gets a CRC
+  // otherwise: a resumed transfer continues from the last chunk that passed.
+  bool withCrc = (peer->app->frameChecksum || type == MSG_FILE_CHUNK) &&
+                 !Transport_IsEncrypted(peer->transport);
+  uint32_t totalLen = 1 + payloadLen + (withCrc ? 4 : 0); // 1 byte for type
+  uint32_t netLen = htonl(totalLen);
+  memcpy(header, &netLen, 4);
+  header[4] = (unsigned char)type | (withCrc ? FRAME_FLAG_CRC : 0);
+  return withCrc;
+}
+
+// Writes one frame whose payload is the concatenation of parts. Header, parts
+// and CRC trailer go out as a single Transport_SendV, so a cleartext frame
+// costs one sendmsg(2). Only the writer thread calls this once it runs.
+static bool WriteFrame(Peer *peer, MessageType type, const struct iovec *parts,
+                       int count) {
+  Transport *t = peer->transport;
+  if (!peer->isConnected || !t)
+    return false;
+  struct iovec iov[TRANSPORT_MAX_IOV];
+  if (count > TRANSPORT_MAX_IOV - 2) {
+    LOG_WARN("Dropping frame (type %d): %d parts is too many", type, count);
+    return false;
+  }
+  size_t payloadLen = 0;
+  for (int i = 0; i < count; i++)
+    payloadLen += parts[i].iov_len;
+
+  unsigned char header[5];
+  bool withCrc = FrameHeader(peer, type, payloadLen, header);
+
+  int n = 0;
+  iov[n++] = (struct iovec){header, sizeof(header)};
+  for (int i = 0; i < count; i++)
+    iov[n++] = parts[i];
+
+  uint32_t netCrc;
+  if (withCrc) {
+    uint32_t crc = Crypto_CRC32C(header + 4, 1);
+    for (int i = 0; i < count; i++)
+      crc = Crypto_CRC32CUpdate(crc, parts[i].iov_base, parts[i].iov_len);
+    netCrc = htonl(crc);
+    iov[n++] = (struct iovec){&netCrc, sizeof(netCrc)};
+  }
+
+  if (!Transport_BeginSend(t)) {
+    LOG_WARN("Dropping frame (type %d): connection handshake incomplete", type);
+    return false;
+  }
+  bool ok = Transport_SendV(t, iov, n);
+  if (!Transport_EndSend(t) || !ok) {
+    LOG_WARN("Failed to send frame (type %d, %zu bytes)", type, payloadLen);
+    return false;
+  }
+  return true;
+}
+
+// Writes a MSG_FILE_CHUNK slice, [offset: 8] followed by len bytes of fd at
+// offset, handed to Transport_SendFile so they never pass through user space.
+// data is a copy of the same bytes, only read for the CRC.
+static bool WriteFileFrame(Peer *peer, int fd, uint64_t offset,
+                           const unsigned char *data, size_t len) {
+  Transport *t = peer->transport;
+  if (!peer->isConnected || !t)
+    return false;
+  unsigned char header[5 + 8];
+  bool withCrc = FrameHeader(peer, MSG_FILE_CHUNK, 8 + len, header);
+  PutBE64(header + 5, offset);
+  uint32_t netCrc = 0;
+  if (withCrc)
+    netCrc = htonl(
+        Crypto_CRC32CUpdate(Crypto_CRC32C(header + 4, 1 + 8), data, len));
+
+  if (!Transport_BeginSend(t))
+    return false;
+  // Should the file have been cut short since data was read, the slice ends
+  // with the bytes read, so the frame is as long as its header says and the
+  // next read ends the transfer
+  size_t sent = 0;
+  bool ok = Transport_Send(t, header, sizeof(header)) &&
+            Transport_SendFile(t, fd, (off_t)offset, len, &sent) &&
+            (sent == len || Transport_Send(t, data + sent, len - sent)) &&
+            (!withCrc || Transport_Send(t, &netCrc, sizeof(netCrc)));
+  if (!Transport_EndSend(t) || !ok) {
+    LOG_WARN("Failed to send file slice (%zu bytes)", len);
+    return false;
   }
   return true;
 }
 
-// Helper to receive exactly N bytes
-static bool RecvAll(int socket, unsigned char *buf, size_t len) {
-  size_t total = 0;
-  while (total < len) {
-    ssize_t n = recv(socket, buf + total, len - total, 0);
+// One of our outgoing transfers (see FileTransfer in common.h for the wire
+// format). It stays with the writer from its header until the peer confirms
+// the whole file, so it can be rewound to whatever offset the peer asks for,
+// on this connection or the next.
+typedef struct BulkSend {
+  SendFrame *frame; // MSG_FILE_BEGIN parts and the body
+  uint64_t id;
+  uint64_t offset; // Next body byte to send
+  bool announced;  // MSG_FILE_BEGIN written on this connection
+  bool adopted;    // Carried over from an earlier connection
+  uint32_t resumes; // Peer's MSG_FILE_RESUMEs acted on this connection
+  uint32_t rewinds; // The same, over every connection
+  // The body is hashed once, in order, as it is first read, so a rewind
+  // costs no rehashing: hash covers the first hashedTo bytes, and once they
+  // are all of them digest holds the result
+  HashCtx *hash;
+  uint64_t hashedTo;
+  bool digested;
+  unsigned char digest[HASH_LEN];
+  struct BulkSend *next;
+} BulkSend;
+
+// The writer's transfers. One streams at a time, read slice by slice into buf
+// and hashed on the way. Files are read, never mapped: a mapping of a file
+// someone truncates meanwhile faults with SIGBUS, where a read just comes up
+// short.
+typedef struct {
+  BulkSend *active;
+  BulkSend *pending; // Carried over or rewound, streamed before new files
+  BulkSend *unacked; // Sent up to MSG_FILE_END, waiting for the peer's word
+  int unackedCount;
+  unsigned char *buf;
+} BulkWriter;
+
+// Fills in the content hash of the chat line SendFile posted for this file
+static void NoteSentHash(AppState *state, const SendFrame *frame,
+                         const unsigned char *digest) {
+  // MSG_FILE_BEGIN parts: [type + name length], [name], [size], [ID]
+  const unsigned char *head = frame->parts[0].iov_base;
+  const char *name = frame->parts[1].iov_base;
+  char content[512];
+  snprintf(content, sizeof(content), "[%s] %.*s",
+           head[0] == MSG_IMAGE ? "Image" : "Audio",
+           (int)frame->parts[1].iov_len, name);
+  pthread_mutex_lock(&state->messageMutex);
+  for (int i = state->messageCount - 1; i >= 0; i--) {
+    ChatMessage *msg = &state->messages[i];
+    if (msg->isSent && msg->contentHash[0] == '\0' &&
+        strcmp(msg->content, content) == 0) {
+      Hash_ToHex(digest, msg->contentHash);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&state->messageMutex);
+}
+
+// Returns len bytes of the active body at offset, and in *fromFile whether
+// they are a copy of the file's, so the file itself can be sent
+static const unsigned char *BulkWriter_Data(BulkWriter *w, uint64_t offset,
+                                            size_t len, bool *fromFile) {
+  SendFrame *frame = w->active->frame;
+  *fromFile = false;
+  if (frame->body)
+    return frame->body + offset;
+
+  if (!w->buf)
+    return NULL;
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = pread(frame->fd, w->buf + got, len - got,
+                      (off_t)(offset + got));
+    if (n < 0 && errno == EINTR)
+      continue;
     if (n <= 0)
+      return NULL;
+    got += n;
+  }
+  *fromFile = true;
+  return w->buf;
+}
+
+// Moves the active transfer to offset. Only a move past what was hashed so
+// far reads the body, to hash the gap.
+static bool BulkWriter_Seek(BulkWriter *w, uint64_t offset) {
+  BulkSend *b = w->active;
+  if (!b->digested && !b->hash && !(b->hash = Hash_Begin()))
+    return false;
+  while (b->hashedTo < offset) {
+    uint64_t left = offset - b->hashedTo;
+    size_t n = left < BULK_SLICE_BYTES ? (size_t)left : BULK_SLICE_BYTES;
+    bool fromFile;
+    const unsigned char *data = BulkWriter_Data(w, b->hashedTo, n, &fromFile);
+    if (!data)
       return false;
-    total += n;
+    Hash_Update(b->hash, data, n);
+    b->hashedTo += n;
   }
+  b->offset = offset;
   return true;
 }
 
-static void SendFramedMessage(AppState *state, MessageType type,
+static void BulkSend_Release(SendQueue *q, BulkSend *b) {
+  // A carried-over frame was queued on an earlier connection's queue
+  if (b->adopted)
+    SendQueue_Drop(b->frame);
+  else
+    SendQueue_Done(q, b->frame);
+  Hash_End(b->hash, NULL);
+  free(b);
+}
+
+static void BulkSend_Append(BulkSend **list, BulkSend *b) {
+  b->next = NULL;
+  while (*list)
+    list = &(*list)->next;
+  *list = b;
+}
+
+static BulkSend **BulkSend_Find(BulkSend **list, uint64_t id) {
+  for (; *list; list = &(*list)->next)
+    if ((*list)->id == id)
+      return list;
+  return NULL;
+}
+
+// Takes the active transfer off the wire; it waits in unacked until the peer
+// confirms it, asks for a rewind or the connection goes
+static void BulkWriter_Park(SendQueue *q, BulkWriter *w) {
+  BulkSend_Append(&w->unacked, w->active);
+  w->active = NULL;
+  if (++w->unackedCount > BULK_MAX_UNACKED) {
+    BulkSend *oldest = w->unacked;
+    w->unacked = oldest->next;
+    w->unackedCount--;
+    LOG_INFO("Peer never confirmed a transfer; forgetting it");
+    BulkSend_Release(q, oldest);
+  }
+}
+
+// Ends the active transfer for good. An announced one is closed with an
+// empty MSG_FILE_END, which the peer reads as the sender giving up if it is
+// still receiving it.
+static void BulkWriter_Abort(Peer *peer, SendQueue *q, BulkWriter *w) {
+  if (w->active->announced)
+    WriteFrame(peer, MSG_FILE_END, NULL, 0);
+  BulkSend_Release(q, w->active);
+  w->active = NULL;
+}
+
+// Makes b the active transfer, announcing it with MSG_FILE_BEGIN unless the
+// peer has already seen it on this connection
+static void BulkWriter_Start(Peer *peer, SendQueue *q, BulkWriter *w,
+                             BulkSend *b) {
+  w->active = b;
+  if (!BulkWriter_Seek(w, b->offset)) {
+    LOG_WARN("Transfer aborted: cannot read the file to send");
+    BulkWriter_Abort(peer, q, w);
+    return;
+  }
+  if (!b->announced) {
+    SendFrame *frame = b->frame;
+    WriteFrame(peer, frame->type, frame->parts, frame->count);
+    b->announced = true;
+  }
+}
+
+// Sends the next slice of the active transfer, or its closing MSG_FILE_END
+static void BulkWriter_Next(Peer *peer, SendQueue *q, BulkWriter *w) {
+  BulkSend *b = w->active;
+  SendFrame *frame = b->frame;
+  if (b->offset == frame->bodyLen) {
+    if (!b->digested) {
+      bool hashed = Hash_End(b->hash, b->digest);
+      b->hash = NULL;
+      if (!hashed) {
+        BulkWriter_Abort(peer, q, w);
+        return;
+      }
+      b->digested = true;
+    }
+    unsigned char resumes[4];
+    uint32_t netResumes = htonl(b->resumes);
+    memcpy(resumes, &netResumes, 4);
+    struct iovec parts[] = {{b->digest, sizeof(b->digest)},
+                            {resumes, sizeof(resumes)}};
+    if (WriteFrame(peer, MSG_FILE_END, parts, 2))
+      NoteSentHash(peer->app, frame, b->digest);
+    BulkWriter_Park(q, w);
+    return;
+  }
+
+  uint64_t left = frame->bodyLen - b->offset;
+  size_t n = left < BULK_SLICE_BYTES ? (size_t)left : BULK_SLICE_BYTES;
+  bool fromFile;
+  const unsigned char *data = BulkWriter_Data(w, b->offset, n, &fromFile);
+  if (!data) {
+    LOG_WARN("Transfer aborted: file read failed at %llu bytes",
+             (unsigned long long)b->offset);
+    BulkWriter_Abort(peer, q, w);
+    return;
+  }
+  // Bytes sent again after a rewind were hashed the first time
+  if (b->offset == b->hashedTo) {
+    Hash_Update(b->hash, data, n);
+    b->hashedTo += n;
+  }
+  uint64_t offset = b->offset;
+  b->offset += n;
+  bool sent;
+  if (fromFile && Transport_ZeroCopy(peer->transport)) {
+    sent = WriteFileFrame(peer, frame->fd, offset, data, n);
+  } else {
+    unsigned char at[8];
+    PutBE64(at, offset);
+    struct iovec parts[] = {{at, sizeof(at)}, {(void *)data, n}};
+    sent = WriteFrame(peer, MSG_FILE_CHUNK, parts, 2);
+  }
+  // The connection is going; what the peer has is settled on the next one
+  if (!sent)
+    BulkWriter_Park(q, w);
+}
+
+// Acts on the peer's MSG_FILE_RESUME or MSG_FILE_REJECT for one of our
+// transfers
+static void BulkWriter_Note(Peer *peer, SendQueue *q, BulkWriter *w,
+                            const SendFrame *note) {
+  const unsigned char *p = note->parts[0].iov_base;
+  BulkSend *b = w->active;
+  BulkSend **list = NULL, **link = NULL;
+  if (note->parts[0].iov_len >= 8) {
+    uint64_t id = GetBE64(p);
+    if (!b || b->id != id) {
+      if ((link = BulkSend_Find(&w->pending, id)))
+        list = &w->pending;
+      else if ((link = BulkSend_Find(&w->unacked, id)))
+        list = &w->unacked;
+      b = link ? *link : NULL;
+    }
+  }
+  if (!b)
+    return;
+
+  uint64_t offset = note->type == NOTE_FILE_RESUME ? GetBE64(p + 8) : 0;
+  bool done = note->type == NOTE_FILE_REJECT || offset >= b->frame->bodyLen;
+  if (note->type == NOTE_FILE_REJECT) {
+    LOG_INFO("Peer rejected the transfer after %llu bytes",
+             (unsigned long long)b->offset);
+  } else if (!done) {
+    LOG_INFO("Peer asks to resume the transfer at %llu bytes",
+             (unsigned long long)offset);
+    b->resumes++;
+    if (++b->rewinds > BULK_MAX_REWINDS) {
+      LOG_WARN("Transfer aborted: peer asked to resume it %d times",
+               BULK_MAX_REWINDS);
+      done = true;
+    }
+  }
+  if (done) {
+    if (b == w->active) {
+      BulkWriter_Abort(peer, q, w);
+    } else {
+      *link = b->next;
+      if (list == &w->unacked)
+        w->unackedCount--;
+      BulkSend_Release(q, b);
+    }
+    return;
+  }
+  if (b == w->active) {
+    if (!BulkWriter_Seek(w, offset))
+      BulkWriter_Abort(peer, q, w);
+    return;
+  }
+  b->offset = offset;
+  if (list == &w->unacked) {
+    *link = b->next;
+    w->unackedCount--;
+    BulkSend_Append(&w->pending, b);
+  }
+}
+
+// Picks up the transfers an earlier connection left unfinished, if this one
+// goes to the same peer
+static void BulkWriter_Adopt(Peer *peer, BulkWriter *w) {
+  BulkSend *b = peer->suspendedSends;
+  peer->suspendedSends = NULL;
+  bool samePeer = strcmp(peer->suspendedPeer, peer->remoteIP) == 0;
+  while (b) {
+    BulkSend *next = b->next;
+    b->announced = false;
+    b->adopted = true;
+    b->resumes = 0;
+    if (samePeer) {
+      BulkSend_Append(&w->pending, b);
+    } else {
+      SendQueue_Drop(b->frame);
+      Hash_End(b->hash, NULL);
+      free(b);
+    }
+    b = next;
+  }
+  if (samePeer && w->pending)
+    ShowStatus(peer->app, "Resuming file transfer...");
+}
+
+// Keeps every unfinished transfer for the next connection, the one that was
+// on the wire first
+static void BulkWriter_Suspend(Peer *peer, BulkWriter *w) {
+  BulkSend **tail = &peer->suspendedSends;
+  if (w->active)
+    BulkSend_Append(tail, w->active);
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = w->pending;
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = w->unacked;
+  w->active = w->pending = w->unacked = NULL;
+  w->unackedCount = 0;
+  if (!peer->suspendedSends)
+    return;
+  memcpy(peer->suspendedPeer, peer->remoteIP, sizeof(peer->suspendedPeer));
+  LOG_INFO("Keeping unfinished file transfers to resume on reconnect");
+}
+
+static SendPriority FramePriority(MessageType type) {
+  switch (type) {
+  case MSG_HELLO:
+  case MSG_PING:
+  case MSG_PONG:
+  case MSG_FILE_REJECT:
+  case MSG_FILE_RESUME:
+    return SEND_PRIO_CONTROL;
+  case MSG_TEXT:
+    return SEND_PRIO_TEXT;
+  default:
+    return SEND_PRIO_BULK;
+  }
+}
+
+// Queues a frame for the writer thread; see SendQueue_Push for ownedPart
+static void SendFramedMessageV(Peer *peer, MessageType type,
+                               const struct iovec *parts, int count,
+                               int ownedPart) {
+  SendQueue *q = peer->sendQueue;
+  if (!peer->isConnected || !q) {
+    if (ownedPart >= 0)
+      free(parts[ownedPart].iov_base);
+    return;
+  }
+  if (!SendQueue_Push(q, FramePriority(type), type, parts, count, ownedPart))
+    LOG_WARN("Dropping frame (type %d): send queue unavailable", type);
+}
+
+static void SendFramedMessage(Peer *peer, MessageType type,
                               const unsigned char *payload, size_t payloadLen) {
-  if (!state->connection.isConnected)
+  struct iovec part = {(void *)payload, payloadLen};
+  SendFramedMessageV(peer, type, &part, 1, -1);
+}
+
+// Corks the writer's socket for a file, if the tuning asks for it, or uncorks
+// it. While corked the kernel only sends full segments, so a slice's header,
+// data and CRC share them; uncorking sends what is held at once.
+static void SetCork(Peer *peer, bool *corked, bool on) {
+  if (*corked == on || (on && !peer->app->tuning.corkBulk))
     return;
-  uint32_t totalLen = 1 + payloadLen; // 1 byte for type
-  uint32_t netLen = htonl(totalLen);
+  int value = on;
+  setsockopt(peer->socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+  *corked = on;
+}
+
+// A chat line leaves the outbox once a writer has sent it. Its frame is the
+// single part BroadcastText built, ending in the line's ID; relayed lines
+// and lines of older peers match nothing pending.
+static void MarkTextWritten(AppState *state, const SendFrame *frame) {
+  if (!state->outbox || frame->count != 1 ||
+      frame->parts[0].iov_len < 4 + TEXT_ID_LEN)
+    return;
+  const unsigned char *payload = frame->parts[0].iov_base;
+  Outbox_MarkSent(state->outbox, GetBE64(payload + frame->parts[0].iov_len -
+                                         TEXT_ID_LEN));
+}
 
-  // Send length prefix (4 bytes)
-  if (!SendAll(state->connection.socket_fd, (const unsigned char *)&netLen, 4))
+// Drains the send queue so frames from every thread go out whole, and nobody
+// but this thread ever waits on the socket. One file at a time is streamed
+// slice by slice; between slices any control or text frame goes first.
+static void *SendFrames(void *arg) {
+  Peer *peer = (Peer *)arg;
+  SendQueue *q = peer->sendQueue;
+  bool corked = false;
+  BulkWriter w = {0};
+  w.buf = malloc(BULK_SLICE_BYTES);
+  BulkWriter_Adopt(peer, &w);
+  for (;;) {
+    bool busy = w.active || w.pending;
+    // About to wait: the end of the last file goes out now
+    if (!busy)
+      SetCork(peer, &corked, false);
+    SendFrame *frame =
+        SendQueue_Pop(q, busy ? SEND_PRIO_TEXT : SEND_PRIO_BULK, !busy);
+    if (frame) {
+      if (frame->type == NOTE_FILE_RESUME || frame->type == NOTE_FILE_REJECT) {
+        BulkWriter_Note(peer, q, &w, frame);
+        SendQueue_Done(q, frame);
+      } else if (frame->fd < 0 && !frame->body) {
+        if (WriteFrame(peer, frame->type, frame->parts, frame->count) &&
+            frame->type == MSG_TEXT)
+          MarkTextWritten(peer->app, frame);
+        SendQueue_Done(q, frame);
+        // Out now, with whatever part segment the file held back
+        SetCork(peer, &corked, false);
+      } else {
+        BulkSend *b = calloc(1, sizeof(BulkSend));
+        if (!b) {
+          SendQueue_Done(q, frame);
+          continue;
+        }
+        // MSG_FILE_BEGIN parts: [type + name length], [name], [size], [ID]
+        b->frame = frame;
+        b->id = GetBE64(frame->parts[3].iov_base);
+        SetCork(peer, &corked, true);
+        BulkWriter_Start(peer, q, &w, b);
+      }
+      continue;
+    }
+    if (SendQueue_Closed(q))
+      break;
+    SetCork(peer, &corked, true);
+    if (w.active) {
+      BulkWriter_Next(peer, q, &w);
+    } else {
+      BulkSend *b = w.pending;
+      w.pending = b->next;
+      BulkWriter_Start(peer, q, &w, b);
+    }
+  }
+  BulkWriter_Suspend(peer, &w);
+  free(w.buf);
+  return NULL;
+}
+
+static bool StartSender(Peer *peer) {
+  peer->sendQueue = SendQueue_Create();
+  if (!peer->sendQueue)
+    return false;
+  if (pthread_create(&peer->sendThread, NULL, SendFrames, peer) != 0) {
+    SendQueue_Destroy(peer->sendQueue);
+    peer->sendQueue = NULL;
+    return false;
+  }
+  return true;
+}
+
+static void StopSender(Peer *peer) {
+  if (!peer->sendQueue)
     return;
+  SendQueue_Close(peer->sendQueue);
+  pthread_join(peer->sendThread, NULL);
+  SendQueue_Destroy(peer->sendQueue);
+  peer->sendQueue = NULL;
+}
+
+// Key the peer's stream is decrypted with, if it turns out to be encrypted
+static const char *ReceiveKey(const AppState *state) {
+  if (!state->useEncryption || state->encryptionKey[0] == '\0')
+    return NULL;
+  return state->encryptionKey;
+}
+
+// Key our own stream is encrypted with, or NULL to send cleartext. TLS
+// already encrypts, so the record layer stays off under it.
+static const char *TransmitKey(const AppState *state) {
+  if (state->useTLS || !state->encryptTransport)
+    return NULL;
+  return ReceiveKey(state);
+}
 
-  // Send type (1 byte)
-  unsigned char typeByte = (unsigned char)type;
-  if (!SendAll(state->connection.socket_fd, &typeByte, 1))
+// Recounts the connected peers; called with peerMutex held
+static void CountPeers(AppState *state) {
+  state->connection.isConnected = false;
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    if (state->connection.peers[i].isConnected)
+      state->connection.isConnected = true;
+}
+
+// Ends a link, live or already dropped, and frees its slot. Its transfers
+// stay in the slot for the next link to the same peer.
+static void ClosePeer(Peer *peer) {
+  AppState *state = peer->app;
+  if (!peer->transport)
     return;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  peer->isConnected = false;
+  peer->threadActive = false;
+  CountPeers(state);
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  // Unblocks both threads, then the socket is closed once they are gone
+  Transport_Close(peer->transport);
+  shutdown(peer->socket_fd, SHUT_RDWR);
+  pthread_join(peer->receiveThread, NULL);
+  pthread_mutex_lock(&state->connection.peerMutex);
+  StopSender(peer);
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  close(peer->socket_fd);
+  Transport_Destroy(peer->transport);
+  peer->transport = NULL;
+}
+
+// Closes the socket and frees the transport of a link that never started
+// its receive thread
+static void AbandonPeer(Peer *peer) {
+  AppState *state = peer->app;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  peer->isConnected = false;
+  CountPeers(state);
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  if (peer->transport)
+    Transport_Close(peer->transport);
+  shutdown(peer->socket_fd, SHUT_RDWR);
+  pthread_mutex_lock(&state->connection.peerMutex);
+  StopSender(peer);
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  close(peer->socket_fd);
+  Transport_Destroy(peer->transport);
+  peer->transport = NULL;
+}
 
-  // Send payload
-  if (payloadLen > 0) {
-    SendAll(state->connection.socket_fd, payload, payloadLen);
+// Slot for a new link from ip: preferably the one holding transfers, either
+// way, left for that peer, else one holding none. Its part file stays with
+// the slot, so an uploader landing elsewhere would start over from byte 0.
+// Slots whose link dropped on its own are reaped on the way. NULL when every
+// slot is live.
+static Peer *FreePeer(AppState *state, const char *ip) {
+  Peer *best = NULL;
+  int bestScore = -1;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Peer *peer = &state->connection.peers[i];
+    pthread_mutex_lock(&state->connection.peerMutex);
+    bool live = peer->isConnected;
+    pthread_mutex_unlock(&state->connection.peerMutex);
+    if (live)
+      continue;
+    ClosePeer(peer);
+    // A slot keeps the address of its last link, whose receive it suspended
+    bool sends = peer->suspendedSends != NULL;
+    bool receive = peer->transfer.suspended;
+    int score = !sends && !receive ? 1 : 0;
+    if ((sends && strcmp(peer->suspendedPeer, ip) == 0) ||
+        (receive && strcmp(peer->remoteIP, ip) == 0))
+      score = 2;
+    if (score > bestScore) {
+      best = peer;
+      bestScore = score;
+    }
   }
+  return best;
 }
 
-void InitializeConnection(AppState *state, bool asServer, const char *ip,
-                          int port) {
-  if (state->connection.isConnected) {
-    CloseConnection(state);
+static bool SetNonBlocking(int fd, bool on) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return false;
+  flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+// Waits for events on fd (-1 to just sleep). Returns 1 once they arrive, 0
+// after timeoutMs (0 waits for good) and -1 once cancelFd (-1 for none) is
+// readable.
+static int WaitForSocket(int fd, short events, int cancelFd, int timeoutMs) {
+  struct pollfd fds[2] = {{fd, events, 0}, {cancelFd, POLLIN, 0}};
+  for (;;) {
+    int n = poll(fds, 2, timeoutMs > 0 ? timeoutMs : -1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 || fds[1].revents)
+      return -1;
+    return n > 0 ? 1 : 0;
   }
-  state->connection.localPort = port;
-  strncpy(state->connection.localIP, asServer ? "0.0.0.0" : "127.0.0.1",
-          sizeof(state->connection.localIP) - 1);
-  state->connection.localIP[sizeof(state->connection.localIP) - 1] = '\0';
-  if (asServer) {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-      ShowStatus(state, "Failed to create socket");
-      return;
+}
+
+// SO_SNDBUF and SO_RCVBUF go on before connect or listen (accepted sockets
+// inherit them), so the window scale the handshake settles on fits
+static void TuneBuffers(int fd, const SocketTuning *tuning) {
+  if (tuning->sendBufferBytes > 0)
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tuning->sendBufferBytes,
+               sizeof(tuning->sendBufferBytes));
+  if (tuning->recvBufferBytes > 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tuning->recvBufferBytes,
+               sizeof(tuning->recvBufferBytes));
+}
+
+// The rest of the tuning, on a connected socket
+static void TuneLink(int fd, const SocketTuning *tuning) {
+  int one = 1;
+  if (tuning->noDelay)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (tuning->quickAck)
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+  if (tuning->keepAliveSec > 0) {
+    // Gives up after three unanswered probes a third of the idle time apart
+    int idle = tuning->keepAliveSec;
+    int interval = idle >= 3 ? idle / 3 : 1;
+    int count = 3;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  }
+  int sendBuf = 0, recvBuf = 0;
+  socklen_t len = sizeof(int);
+  getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuf, &len);
+  len = sizeof(int);
+  getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &recvBuf, &len);
+  LOG_INFO("Socket tuning: nodelay %d, cork %d, quickack %d, keepalive %d s, "
+           "sndbuf %d, rcvbuf %d%s",
+           tuning->noDelay, tuning->corkBulk, tuning->quickAck,
+           tuning->keepAliveSec, sendBuf, recvBuf,
+           tuning->sendBufferBytes || tuning->recvBufferBytes
+               ? ""
+               : " (autotuned)");
+}
+
+static bool Cancelled(int cancelFd) {
+  struct pollfd fd = {cancelFd, POLLIN, 0};
+  return cancelFd >= 0 && poll(&fd, 1, 0) > 0;
+}
+
+// Queues one frame for every connected peer but except, and returns how many
+// took it. The payload is copied once, into a buffer all their queues send
+// from.
+static int Broadcast(AppState *state, const Peer *except, MessageType type,
+                     const unsigned char *payload, size_t payloadLen) {
+  SendShared *shared = NULL;
+  int queued = 0;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Peer *peer = &state->connection.peers[i];
+    if (peer == except || !peer->isConnected || !peer->sendQueue)
+      continue;
+    if (!shared) {
+      if (!(shared = SendShared_Create(payloadLen)))
+        break;
+      memcpy(shared->data, payload, payloadLen);
     }
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    struct sockaddr_in address;
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-      ShowStatus(state, "Bind failed");
-      close(server_fd);
-      return;
+    struct iovec part = {shared->data, payloadLen};
+    if (SendQueue_PushShared(peer->sendQueue, FramePriority(type), type,
+                             &part, 1, 0, shared))
+      queued++;
+    else
+      LOG_WARN("Dropping frame (type %d) to %s: send queue unavailable", type,
+               peer->remoteIP);
+  }
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  SendShared_Release(shared);
+  return queued;
+}
+
+// Sends a chat line, tagged with its ID, to every connected peer
+static int BroadcastText(AppState *state, uint64_t id, const char *text) {
+  // Receivers drop anything longer, so cap it and build the frame on the stack
+  uint32_t len = strnlen(text, MAX_MESSAGE_LENGTH);
+  uint32_t netLen = htonl(len);
+  unsigned char payload[4 + MAX_MESSAGE_LENGTH + TEXT_ID_LEN];
+  memcpy(payload, &netLen, 4);
+  memcpy(payload + 4, text, len);
+  PutBE64(payload + 4 + len, id);
+  return Broadcast(state, NULL, MSG_TEXT, payload, 4 + len + TEXT_ID_LEN);
+}
+
+// Queues every pending line of the outbox, oldest first, for the link just
+// made, including any an earlier link took but never wrote; receivers drop
+// the ones they already have by their IDs. The outbox stays locked
+// throughout, so a line typed meanwhile queues up behind them rather than
+// overtaking them. Nothing here waits on the disk: lines leave the outbox
+// once a writer has sent them (see MarkTextWritten).
+static void ReplayOutbox(AppState *state) {
+  Outbox *o = state->outbox;
+  if (!o)
+    return;
+  pthread_mutex_lock(&o->lock);
+  o->queued = 0;
+  while (o->queued < o->count &&
+         BroadcastText(state, o->pending[o->queued].id,
+                       o->pending[o->queued].text) > 0)
+    o->queued++;
+  int queued = o->queued, left = o->count - o->queued;
+  pthread_mutex_unlock(&o->lock);
+  if (queued > 0)
+    LOG_INFO("Sending %d queued messages, %d still waiting", queued, left);
+}
+
+// Runs a freshly connected socket up to a live link in peer: transport, TLS
+// handshake, hello, writer and receive threads. Takes over fd.
+static bool LinkPeer(AppState *state, Peer *peer, int fd, bool asServer,
+                     int cancelFd) {
+  peer->app = state;
+  peer->socket_fd = fd;
+  int lowat = SEND_LOWAT_BYTES;
+  setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+  TuneLink(fd, &state->tuning);
+
+  peer->transport = Transport_Create(fd);
+  if (!peer->transport) {
+    ShowStatus(state, "Memory allocation failed");
+    close(fd);
+    return false;
+  }
+
+  if (state->useTLS) {
+    // The handshake runs non-blocking so it can time out or be cancelled;
+    // afterwards the writer blocks and receives sleep in epoll
+    state->connection.connectPhase = CONNECT_HANDSHAKE;
+    TlsConfig tls = {state->tlsCertPath, state->tlsKeyPath, state->tlsCAPath,
+                     state->tlsInsecure};
+    struct ssl_st *ssl = NULL;
+    if (SetNonBlocking(fd, true))
+      ssl = asServer ? Tls_Accept(fd, &tls, cancelFd)
+                     : Tls_Connect(fd, peer->remoteIP, peer->remotePort, &tls,
+                                   cancelFd);
+    if (ssl)
+      Transport_AttachTLS(peer->transport, ssl);
+    if (!ssl || !SetNonBlocking(fd, false)) {
+      bool noCA = !asServer && !state->tlsInsecure &&
+                  access(state->tlsCAPath, R_OK) != 0;
+      ShowStatus(state, Cancelled(cancelFd) ? "Connection cancelled"
+                        : noCA ? "No CA certificate to verify the server with"
+                               : "TLS handshake failed");
+      AbandonPeer(peer);
+      return false;
     }
+  }
 
-    if (listen(server_fd, 3) < 0) {
-      ShowStatus(state, "Listen failed");
-      close(server_fd);
-      return;
+  // The hello goes out in cleartext; with a transport key everything after
+  // it is sealed into records
+  peer->isConnected = true;
+  unsigned char hello[TRANSPORT_HELLO_LEN];
+  if (!Transport_MakeHello(peer->transport, TransmitKey(state), hello)) {
+    ShowStatus(state, "Failed to derive transport key");
+    AbandonPeer(peer);
+    return false;
+  }
+  struct iovec helloPart = {hello, sizeof(hello)};
+  WriteFrame(peer, MSG_HELLO, &helloPart, 1);
+  Transport_StartTx(peer->transport);
+
+  peer->threadActive = true;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  // Under the lock, as SendPing may already be sending to this peer
+  atomic_store(&peer->pingSeq, 0);
+  atomic_store(&peer->unansweredSinceNs, 0);
+  for (int i = 0; i < PING_WINDOW; i++)
+    atomic_store(&peer->pingSentNs[i], 0);
+  Histogram_Reset(&peer->rtt);
+  bool started = StartSender(peer);
+  CountPeers(state);
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  if (!started) {
+    ShowStatus(state, "Failed to create send thread");
+    AbandonPeer(peer);
+    return false;
+  }
+  if (pthread_create(&peer->receiveThread, NULL, ReceiveMessages, peer) != 0) {
+    ShowStatus(state, "Failed to create receive thread");
+    AbandonPeer(peer);
+    return false;
+  }
+  state->showConnectionDialog = false;
+  if (!state->useTLS)
+    ShowStatus(state, "Connected!");
+  else if (Tls_Resumed(peer->transport->ssl))
+    ShowStatus(state, "Connected over TLS (resumed session)");
+  else
+    ShowStatus(state, "Connected over TLS");
+  ReplayOutbox(state);
+  return true;
+}
+
+// Server side of Connect: links peers as they arrive, into free slots, until
+// cancelled, or after the first one unless keepListening
+static void Serve(AppState *state, int port, int cancelFd, bool keepListening) {
+  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_fd < 0) {
+    ShowStatus(state, "Failed to create socket");
+    return;
+  }
+  int opt = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  TuneBuffers(server_fd, &state->tuning);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    ShowStatus(state, "Bind failed");
+    close(server_fd);
+    return;
+  }
+
+  if (listen(server_fd, MAX_CLIENTS) < 0 ||
+      !SetNonBlocking(server_fd, true)) {
+    ShowStatus(state, "Listen failed");
+    close(server_fd);
+    return;
+  }
+  ShowStatus(state, "Waiting for connection...");
+  int linked = 0;
+  for (;;) {
+    state->connection.connectPhase = CONNECT_LISTENING;
+    // Only the first peer is waited for with a timeout
+    int ready = WaitForSocket(server_fd, POLLIN, cancelFd,
+                              linked ? 0 : state->acceptTimeoutMs);
+    if (ready <= 0) {
+      if (!linked)
+        ShowStatus(state, ready == 0 ? "No peer connected in time"
+                                     : "Connection cancelled");
+      break;
     }
-    ShowStatus(state, "Waiting for connection...");
     struct sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
     memset(&client_addr, 0, sizeof(client_addr));
-    state->connection.socket_fd =
-        accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
-    if (state->connection.socket_fd < 0) {
+    int fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
+    if (fd < 0) {
+      // The peer may have given up between poll and accept
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED ||
+          errno == EINTR)
+        continue;
       ShowStatus(state, "Accept failed");
-      close(server_fd);
-      return;
+      break;
     }
-    strncpy(state->connection.remoteIP, inet_ntoa(client_addr.sin_addr),
-            sizeof(state->connection.remoteIP) - 1);
-    state->connection.remoteIP[sizeof(state->connection.remoteIP) - 1] = '\0';
-    state->connection.remotePort = ntohs(client_addr.sin_port);
-    close(server_fd);
-  } else {
-    state->connection.socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (state->connection.socket_fd < 0) {
-      ShowStatus(state, "Failed to create socket");
-      return;
+    const char *ip = inet_ntoa(client_addr.sin_addr);
+    Peer *peer = FreePeer(state, ip);
+    if (!peer) {
+      LOG_WARN("Turning away %s: %d peers connected", ip, MAX_CLIENTS);
+      close(fd);
+      continue;
     }
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-
-    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
-      ShowStatus(state, "Invalid address");
-      close(state->connection.socket_fd);
-      return;
+    strncpy(peer->remoteIP, ip, sizeof(peer->remoteIP) - 1);
+    peer->remoteIP[sizeof(peer->remoteIP) - 1] = '\0';
+    peer->remotePort = ntohs(client_addr.sin_port);
+    snprintf(peer->name, sizeof(peer->name), "Contact %d",
+             (int)(peer - state->connection.peers) + 1);
+    if (LinkPeer(state, peer, fd, true, cancelFd)) {
+      linked++;
+      LOG_INFO("Peer %s:%d connected", peer->remoteIP, peer->remotePort);
+      if (!keepListening)
+        break;
     }
+  }
+  close(server_fd);
+}
 
-    // Connect with simple timeout struct if needed, but standard block is ok
-    // for now.
-    struct timeval tv;
-    tv.tv_sec = 5; // 5 second timeout on recv
-    tv.tv_usec = 0;
+// Client side of Connect, into the single slot; true once linked
+static bool Dial(AppState *state, const char *ip, int port, int cancelFd) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    ShowStatus(state, "Failed to create socket");
+    return false;
+  }
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
 
-    if (connect(state->connection.socket_fd, (struct sockaddr *)&server_addr,
-                sizeof(server_addr)) < 0) {
-      ShowStatus(state, "Connection failed");
-      close(state->connection.socket_fd);
-      return;
-    }
+  if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
+    ShowStatus(state, "Invalid address");
+    close(fd);
+    return false;
+  }
+
+  TuneBuffers(fd, &state->tuning);
+  state->connection.connectPhase = CONNECT_DIALING;
+  const char *failure = "Connection failed";
+  int rc = -1;
+  if (SetNonBlocking(fd, true))
+    rc = connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+  if (rc < 0 && errno == EINPROGRESS) {
+    int ready = WaitForSocket(fd, POLLOUT, cancelFd, state->connectTimeoutMs);
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    if (ready == 0)
+      failure = "Connection timed out";
+    else if (ready < 0)
+      failure = "Connection cancelled";
+    else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == 0 &&
+             err == 0)
+      rc = 0;
+  }
+  if (rc < 0 || !SetNonBlocking(fd, false)) {
+    ShowStatus(state, failure);
+    close(fd);
+    return false;
+  }
+
+  Peer *peer = &state->connection.peers[0];
+  strncpy(peer->remoteIP, ip, sizeof(peer->remoteIP) - 1);
+  peer->remoteIP[sizeof(peer->remoteIP) - 1] = '\0';
+  peer->remotePort = port;
+  strcpy(peer->name, "Contact");
+  return LinkPeer(state, peer, fd, false, cancelFd);
+}
 
-    setsockopt(state->connection.socket_fd, SOL_SOCKET, SO_RCVTIMEO,
-               (const char *)&tv, sizeof(tv));
+// Delay before redial attempt n (from 0): doubles from REDIAL_BASE_MS up to
+// REDIAL_MAX_MS, then a random point in its upper half, so clients dropped
+// together by a restarting server do not all come back at once
+#define REDIAL_BASE_MS 500
+#define REDIAL_MAX_MS 30000
+static int RedialDelayMs(int attempt) {
+  int ms = REDIAL_BASE_MS;
+  for (int i = 0; i < attempt && ms < REDIAL_MAX_MS; i++)
+    ms *= 2;
+  if (ms > REDIAL_MAX_MS)
+    ms = REDIAL_MAX_MS;
+  uint32_t r = 0;
+  Crypto_RandomBytes((unsigned char *)&r, sizeof(r));
+  return ms / 2 + (int)(r % (uint32_t)(ms / 2 + 1));
+}
 
-    strncpy(state->connection.remoteIP, ip,
-            sizeof(state->connection.remoteIP) - 1);
-    state->connection.remoteIP[sizeof(state->connection.remoteIP) - 1] = '\0';
-    state->connection.remotePort = port;
+// Background client: dials, and each time the link drops dials again after a
+// backoff, until cancelled. A first dial that fails is not retried, so a
+// mistyped address still fails the way it always did.
+static void KeepDialing(AppState *state, const char *ip, int port,
+                        int cancelFd) {
+  ConnectionInfo *conn = &state->connection;
+  bool linked = Dial(state, ip, port, cancelFd);
+  if (!linked)
+    return;
+  int attempt = 0;
+  for (;;) {
+    if (linked) {
+      attempt = 0;
+      conn->connectPhase = CONNECT_IDLE;
+      uint64_t drops;
+      if (WaitForSocket(conn->linkDownFd, POLLIN, cancelFd, 0) < 0 ||
+          read(conn->linkDownFd, &drops, sizeof(drops)) < 0)
+        return;
+      // Reap the dead link; its transfers stay for the next one
+      ClosePeer(&conn->peers[0]);
+    }
+    int delayMs = RedialDelayMs(attempt++);
+    conn->redialAttempt = attempt;
+    conn->redialAt = GetTime() + delayMs / 1000.0;
+    conn->connectPhase = CONNECT_BACKOFF;
+    LOG_INFO("Redialing %s:%d in %d ms (attempt %d)", ip, port, delayMs,
+             attempt);
+    if (WaitForSocket(-1, 0, cancelFd, delayMs) != 0)
+      return;
+    conn->connectStarted = GetTime();
+    linked = Dial(state, ip, port, cancelFd);
   }
+}
 
-  // Set timeout for both
-  struct timeval tv_recv;
-  tv_recv.tv_sec = 2; // 2 seconds recv timeout allowing thread loop
-  tv_recv.tv_usec = 0;
-  setsockopt(state->connection.socket_fd, SOL_SOCKET, SO_RCVTIMEO,
-             (const char *)&tv_recv, sizeof(tv_recv));
+// Does the work of InitializeConnection and StartConnection. Every wait
+// (accept, connect, TLS handshake) also ends when cancelFd becomes readable.
+// With keep a server goes on accepting, and a client set to redial does.
+static void Connect(AppState *state, bool asServer, const char *ip, int port,
+                    int cancelFd, bool keep) {
+  state->connection.localPort = port;
+  strncpy(state->connection.localIP, asServer ? "0.0.0.0" : "127.0.0.1",
+          sizeof(state->connection.localIP) - 1);
+  state->connection.localIP[sizeof(state->connection.localIP) - 1] = '\0';
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    state->connection.peers[i].app = state;
+  if (asServer)
+    Serve(state, port, cancelFd, keep);
+  else if (keep && state->connection.redial)
+    KeepDialing(state, ip, port, cancelFd);
+  else
+    Dial(state, ip, port, cancelFd);
+}
 
-  state->connection.isConnected = true;
-  state->connection.threadActive = true;
-  state->connection.lastPingSent = GetTime();
-  state->connection.lastPongReceived = GetTime();
-  state->connection.latency = 0;
-  state->showConnectionDialog = false;
-  ShowStatus(state, "Connected!");
-  int result = pthread_create(&state->connection.receiveThread, NULL,
-                              ReceiveMessages, state);
-  if (result != 0) {
-    ShowStatus(state, "Failed to create receive thread");
-    state->connection.isConnected = false;
-    close(state->connection.socket_fd);
+static bool HasPeers(AppState *state) {
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    if (state->connection.peers[i].transport)
+      return true;
+  return false;
+}
+
+void InitializeConnection(AppState *state, bool asServer, const char *ip,
+                          int port) {
+  if (state->connection.connectPending || HasPeers(state))
+    CloseConnection(state);
+  Connect(state, asServer, ip, port, -1, false);
+  state->connection.connectPhase = CONNECT_IDLE;
+}
+
+typedef struct {
+  AppState *state;
+  bool asServer;
+  char ip[64];
+  int port;
+} ConnectJob;
+
+static void *ConnectInBackground(void *arg) {
+  ConnectJob *job = (ConnectJob *)arg;
+  AppState *state = job->state;
+  Connect(state, job->asServer, job->ip, job->port, state->connection.cancelFd,
+          true);
+  state->connection.connectPhase = CONNECT_IDLE;
+  free(job);
+  return NULL;
+}
+
+void StartConnection(AppState *state, bool asServer, const char *ip,
+                     int port) {
+  if (state->connection.connectPending || HasPeers(state))
+    CloseConnection(state);
+  ConnectJob *job = (ConnectJob *)calloc(1, sizeof(ConnectJob));
+  if (!job) {
+    ShowStatus(state, "Memory allocation failed");
+    return;
   }
+  job->state = state;
+  job->asServer = asServer;
+  strncpy(job->ip, ip, sizeof(job->ip) - 1);
+  job->port = port;
+
+  state->connection.cancelFd = eventfd(0, EFD_CLOEXEC);
+  state->connection.connectStarted = GetTime();
+  state->connection.connectPhase =
+      asServer ? CONNECT_LISTENING : CONNECT_DIALING;
+  // Without an eventfd to hear of drops the client just does not redial
+  state->connection.redial = false;
+  if (!asServer && state->autoReconnect &&
+      (state->connection.linkDownFd = eventfd(0, EFD_CLOEXEC)) >= 0)
+    state->connection.redial = true;
+  if (state->connection.cancelFd < 0 ||
+      pthread_create(&state->connection.connectThread, NULL,
+                     ConnectInBackground, job) != 0) {
+    if (state->connection.cancelFd >= 0)
+      close(state->connection.cancelFd);
+    if (state->connection.redial)
+      close(state->connection.linkDownFd);
+    state->connection.redial = false;
+    state->connection.connectPhase = CONNECT_IDLE;
+    free(job);
+    ShowStatus(state, "Failed to create connect thread");
+    return;
+  }
+  state->connection.connectPending = true;
 }
 
 void CloseConnection(AppState *state) {
-  if (state->connection.isConnected) {
-    state->connection.isConnected = false;
-    state->connection.threadActive = false;
-    shutdown(state->connection.socket_fd, SHUT_RDWR);
-    close(state->connection.socket_fd);
-    pthread_join(state->connection.receiveThread, NULL);
+  // Cut short an attempt still running (or a server still accepting), then
+  // close whatever it got to
+  if (state->connection.connectPending) {
+    uint64_t one = 1;
+    ssize_t cancelled =
+        write(state->connection.cancelFd, &one, sizeof(one));
+    (void)cancelled;
+    pthread_join(state->connection.connectThread, NULL);
+    close(state->connection.cancelFd);
+    state->connection.connectPending = false;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    ClosePeer(&state->connection.peers[i]);
+  // Only now, with every receive thread gone, is nobody left to signal it
+  if (state->connection.redial) {
+    close(state->connection.linkDownFd);
+    state->connection.redial = false;
   }
 }
 
-void SendMessage(AppState *state, const char *message, MessageType type) {
-  if (!state->connection.isConnected || !message)
-    return;
-
-  uint32_t msgLen = strlen(message);
-  uint32_t netMsgLen = htonl(msgLen);
+bool GetSendQueueStats(AppState *state, SendQueueStats *out) {
+  bool any = false;
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    SendQueue *q = state->connection.peers[i].sendQueue;
+    if (!q)
+      continue;
+    // Totals across peers, and the latency of the slowest
+    SendQueueStats stats;
+    SendQueue_Stats(q, &stats);
+    out->depth += stats.depth;
+    out->sent += stats.sent;
+    if (stats.avgMs >= out->avgMs) {
+      out->lastMs = stats.lastMs;
+      out->avgMs = stats.avgMs;
+    }
+    if (stats.maxMs > out->maxMs)
+      out->maxMs = stats.maxMs;
+    any = true;
+  }
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  return any;
+}
 
-  size_t payloadLen = sizeof(uint32_t) + msgLen;
-  unsigned char *payload = (unsigned char *)malloc(payloadLen);
-  if (!payload)
-    return;
+bool GetRttStats(AppState *state, RttStats *out) {
+  bool any = false;
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Peer *peer = &state->connection.peers[i];
+    if (!peer->isConnected)
+      continue;
+    uint64_t pongs = Histogram_Count(&peer->rtt);
+    out->pings += atomic_load(&peer->pingSeq);
+    out->pongs += pongs;
+    if (pongs == 0)
+      continue;
+    double p99 = Histogram_Percentile(&peer->rtt, 0.99) / 1e6;
+    if (!any || p99 > out->p99Ms) {
+      out->p50Ms = Histogram_Percentile(&peer->rtt, 0.50) / 1e6;
+      out->p99Ms = p99;
+      out->maxMs = Histogram_Max(&peer->rtt) / 1e6;
+    }
+    any = true;
+  }
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  return any;
+}
 
-  memcpy(payload, &netMsgLen, sizeof(uint32_t));
-  memcpy(payload + sizeof(uint32_t), message, msgLen);
+void ResetRttStats(AppState *state) {
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Peer *peer = &state->connection.peers[i];
+    // Pings in flight are timed into the fresh figures
+    atomic_store(&peer->pingSeq, 0);
+    Histogram_Reset(&peer->rtt);
+  }
+  pthread_mutex_unlock(&state->connection.peerMutex);
+}
 
-  SendFramedMessage(state, type, payload, payloadLen);
-  free(payload);
+void SendMessage(AppState *state, const char *message, MessageType type) {
+  Outbox *o = state->outbox;
+  if (!message || (!state->connection.isConnected && !o))
+    return;
+  unsigned char idBytes[TEXT_ID_LEN];
+  if (!Crypto_RandomBytes(idBytes, sizeof(idBytes))) {
+    ShowStatus(state, "Failed to generate message ID");
+    return;
+  }
+  uint64_t id = GetBE64(idBytes);
 
+  if (!o) {
+    BroadcastText(state, id, message);
+    AddMessage(state, "You", message, type, true);
+    return;
+  }
+  // Every line is journaled until a writer has sent it, so one a dropping
+  // link took but never wrote goes out again on the next
+  pthread_mutex_lock(&o->lock);
+  if (!Outbox_Append(o, id, message)) {
+    ShowStatus(state, o->count == OUTBOX_MAX_PENDING
+                          ? "Outbox full; message not sent"
+                          : "Failed to queue message");
+    pthread_mutex_unlock(&o->lock);
+    return;
+  }
   AddMessage(state, "You", message, type, true);
+  // Lines still waiting for a link go first, so this one waits behind them
+  if (o->queued == o->count - 1 && BroadcastText(state, id, message) > 0) {
+    o->queued++;
+  } else {
+    char status[64];
+    snprintf(status, sizeof(status), "Message queued; %d waiting for a link",
+             o->count - o->queued);
+    ShowStatus(state, status);
+  }
+  pthread_mutex_unlock(&o->lock);
 }
 
 void SendFile(AppState *state, const char *filepath, MessageType type) {
@@ -209,261 +1334,739 @@ void SendFile(AppState *state, const char *filepath, MessageType type) {
     return;
   }
 
-  char actualFilePath[256];
-  strncpy(actualFilePath, filepath, sizeof(actualFilePath) - 1);
-  actualFilePath[sizeof(actualFilePath) - 1] = '\0';
-
+  // A carrier with a hidden message is encoded in memory, once, and every
+  // peer is sent the same copy
+  SendShared *carrier = NULL;
+  int fd = -1;
+  struct stat st;
   if (strlen(state->hiddenMessageBuffer) > 0) {
-    if (type == MSG_IMAGE) {
-      sprintf(actualFilePath, "temp_encoded_%d.png", (int)time(NULL));
-      EncodeMessageInImage(state, filepath, state->hiddenMessageBuffer,
-                           actualFilePath);
-    } else if (type == MSG_AUDIO) {
-      sprintf(actualFilePath, "temp_encoded_%d.wav", (int)time(NULL));
-      EncodeMessageInAudio(state, filepath, state->hiddenMessageBuffer,
-                           actualFilePath);
+    unsigned char *encoded = NULL;
+    size_t encodedLen = 0;
+    if (type == MSG_IMAGE)
+      encoded = EncodeMessageInImageToMemory(
+          state, filepath, state->hiddenMessageBuffer, &encodedLen);
+    else if (type == MSG_AUDIO)
+      encoded = EncodeMessageInAudioToMemory(
+          state, filepath, state->hiddenMessageBuffer, &encodedLen);
+    if (!encoded)
+      return; // The encoder has said why
+    if (!(carrier = SendShared_Adopt(encoded, encodedLen))) {
+      ShowStatus(state, "Memory allocation failed");
+      return;
+    }
+  } else {
+    fd = open(filepath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+      if (fd >= 0)
+        close(fd);
+      ShowStatus(state, "Failed to open file to send");
+      return;
     }
   }
+  uint64_t bodyLen = carrier ? carrier->len : (uint64_t)st.st_size;
 
-  FILE *file = fopen(actualFilePath, "rb");
-  if (!file) {
-    ShowStatus(state, "Failed to open file to send");
+  const char *filename = strrchr(filepath, '/');
+  filename = filename ? filename + 1 : filepath;
+  uint32_t nameLen = strnlen(filename, 255);
+
+  // Transfer header; the writer thread streams the body and the hash
+  unsigned char head[5];
+  head[0] = (unsigned char)type;
+  uint32_t netNameLen = htonl(nameLen);
+  memcpy(head + 1, &netNameLen, 4);
+  unsigned char size[8], id[8];
+  PutBE64(size, bodyLen);
+  // Names the transfer across reconnects, so it can resume where it stopped
+  if (!Crypto_RandomBytes(id, sizeof(id))) {
+    if (fd >= 0)
+      close(fd);
+    SendShared_Release(carrier);
+    ShowStatus(state, "Failed to queue file");
     return;
   }
+  struct iovec parts[] = {{head, sizeof(head)},
+                          {(void *)filename, nameLen},
+                          {size, sizeof(size)},
+                          {id, sizeof(id)}};
 
-  fseek(file, 0, SEEK_END);
-  long fileSize = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  // Post the chat line first: the writer fills in its hash when it finishes
+  char msg[512];
+  sprintf(msg, "[%s] %.*s", type == MSG_IMAGE ? "Image" : "Audio",
+          (int)nameLen, filename);
+  pthread_mutex_lock(&state->messageMutex);
+  AddMessage(state, "You", msg, type, true);
+  pthread_mutex_unlock(&state->messageMutex);
 
-  if (fileSize <= 0 || fileSize > 10 * 1024 * 1024) {
-    fclose(file);
-    ShowStatus(state, "File too large or invalid");
+  // Each peer's writer streams the file on its own, through its own fd
+  int queued = 0;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Peer *peer = &state->connection.peers[i];
+    if (!peer->isConnected || !peer->sendQueue)
+      continue;
+    if (carrier) {
+      queued += SendQueue_PushShared(peer->sendQueue, SEND_PRIO_BULK,
+                                     MSG_FILE_BEGIN, parts, 4, -1, carrier);
+      continue;
+    }
+    int peerFd = dup(fd);
+    if (peerFd >= 0)
+      queued += SendQueue_PushFile(peer->sendQueue, SEND_PRIO_BULK,
+                                   MSG_FILE_BEGIN, parts, 4, peerFd, bodyLen);
+  }
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  if (fd >= 0)
+    close(fd);
+  SendShared_Release(carrier);
+  if (!queued) {
+    ShowStatus(state, "Failed to queue file");
     return;
   }
 
-  unsigned char *fileData = (unsigned char *)malloc(fileSize);
-  if (!fileData) {
-    fclose(file);
-    ShowStatus(state, "Memory allocation failed");
+  if (strlen(state->hiddenMessageBuffer) > 0) {
+    ShowStatus(state, "Sending file with hidden message...");
+    state->hiddenMessageBuffer[0] = '\0';
+  } else {
+    ShowStatus(state, "Sending file...");
+  }
+}
+
+static const char *TransportStatusText(TransportStatus st) {
+  switch (st) {
+  case TRANSPORT_CLOSED:
+    return "Connection closed by peer";
+  case TRANSPORT_BAD_RECORD:
+    return "Connection dropped: record failed authentication";
+  default:
+    return "Connection lost";
+  }
+}
+
+// Copies a peer-supplied file name into filename (256 bytes) with path
+// separators and ".." defused, and checks its extension suits the type
+static bool AcceptFileName(AppState *state, MessageType type,
+                           const unsigned char *name, uint32_t nameLen,
+                           char *filename) {
+  size_t cpyLen = (nameLen < 255) ? nameLen : 255;
+  memset(filename, 0, 256);
+  memcpy(filename, name, cpyLen);
+
+  // Sanitize filename: replace path separators and ".." components
+  for (size_t k = 0; k < cpyLen; k++) {
+    if (filename[k] == '/' || filename[k] == '\\') {
+      filename[k] = '_';
+    }
+  }
+  char *dotdot = strstr(filename, "..");
+  while (dotdot) {
+    dotdot[0] = '_';
+    dotdot[1] = '_';
+    dotdot = strstr(filename, "..");
+  }
+
+  bool validExt = false;
+  char *ext = strrchr(filename, '.');
+  if (ext) {
+    if (type == MSG_IMAGE &&
+        (strcasecmp(ext, ".png") == 0 || strcasecmp(ext, ".jpg") == 0 ||
+         strcasecmp(ext, ".jpeg") == 0))
+      validExt = true;
+    else if (type == MSG_AUDIO &&
+             (strcasecmp(ext, ".wav") == 0 || strcasecmp(ext, ".mp3") == 0 ||
+              strcasecmp(ext, ".ogg") == 0))
+      validExt = true;
+  }
+  if (!validExt)
+    ShowStatus(state, "Rejected received file: Untrusted extension");
+  return validExt;
+}
+
+// Looks for a hidden message in a saved file and posts it to the chat
+// Name a file from peer is saved under, after "received_": peers past the
+// first get their slot number before the extension, so two sending the same
+// name never overwrite each other's file (or part file)
+static void SavedName(const Peer *peer, const char *filename, char *out,
+                      size_t outSize) {
+  int slot = (int)(peer - peer->app->connection.peers);
+  const char *ext = strrchr(filename, '.');
+  if (slot == 0)
+    snprintf(out, outSize, "%s", filename);
+  else if (!ext || ext == filename)
+    snprintf(out, outSize, "%s.%d", filename, slot);
+  else
+    snprintf(out, outSize, "%.*s.%d%s", (int)(ext - filename), filename, slot,
+             ext);
+}
+
+static void PostReceivedFile(AppState *state, const char *sender,
+                             MessageType type, const char *savePath,
+                             const char *filename,
+                             const unsigned char *digest) {
+  char hiddenMsg[STEGO_MAX_MESSAGE_LEN + 1];
+  bool hasHidden = false;
+  if (type == MSG_IMAGE) {
+    hasHidden = DecodeMessageFromImageInto(state, savePath, hiddenMsg,
+                                           sizeof(hiddenMsg));
+  } else if (type == MSG_AUDIO) {
+    hasHidden = DecodeMessageFromAudioInto(state, savePath, hiddenMsg,
+                                           sizeof(hiddenMsg));
+  }
+
+  pthread_mutex_lock(&state->messageMutex);
+  char msg[512];
+  sprintf(msg, "[%s] %s", type == MSG_IMAGE ? "Image" : "Audio", filename);
+  AddMessage(state, sender, msg, type, false);
+  ChatMessage *added = &state->messages[state->messageCount - 1];
+  if (digest)
+    Hash_ToHex(digest, added->contentHash);
+
+  if (hasHidden && strlen(hiddenMsg) > 0) {
+    added->hasHiddenMessage = true;
+    size_t n = strnlen(hiddenMsg, sizeof(added->hiddenMessage) - 1);
+    memcpy(added->hiddenMessage, hiddenMsg, n);
+    added->hiddenMessage[n] = '\0';
+  }
+  pthread_mutex_unlock(&state->messageMutex);
+}
+
+// Single-frame image or audio transfer, as sent by older peers:
+// [nameLen][name][fileSize: 4][data][SHA-256, newer senders only]
+static void ReceiveFile(Peer *peer, MessageType type, const unsigned char *data,
+                        size_t payloadBytes) {
+  AppState *state = peer->app;
+  if (payloadBytes < 8)
+    return;
+  uint32_t netNameLen;
+  memcpy(&netNameLen, data, 4);
+  uint32_t nameLen = ntohl(netNameLen);
+  if (payloadBytes < 4 + (size_t)nameLen + 4)
+    return;
+
+  char filename[256];
+  if (!AcceptFileName(state, type, data + 4, nameLen, filename))
+    return;
+
+  uint32_t netFileSize;
+  memcpy(&netFileSize, data + 4 + nameLen, 4);
+  uint32_t fileSize = ntohl(netFileSize);
+  if (payloadBytes < 4 + (size_t)nameLen + 4 + fileSize)
     return;
+
+  // Older senders omit the trailing content hash
+  const unsigned char *fileData = data + 4 + nameLen + 4;
+  unsigned char digest[HASH_LEN];
+  bool hashed = Hash_Buffer(fileData, fileSize, digest);
+  if (payloadBytes >= 4 + (size_t)nameLen + 4 + fileSize + HASH_LEN) {
+    if (!hashed || !Hash_Equal(digest, fileData + fileSize)) {
+      LOG_WARN("Content hash mismatch for %s (%u bytes)", filename, fileSize);
+      ShowStatus(state, "Rejected received file: hash mismatch");
+      return;
+    }
   }
 
-  size_t bytesRead = fread(fileData, 1, fileSize, file);
-  fclose(file);
-  if (bytesRead != (size_t)fileSize) {
-    free(fileData);
-    ShowStatus(state, "Failed to read file");
+  char name[272], savePath[288];
+  SavedName(peer, filename, name, sizeof(name));
+  snprintf(savePath, sizeof(savePath), "received_%s", name);
+  FILE *saveFile = fopen(savePath, "wb");
+  if (!saveFile)
     return;
+  fwrite(fileData, 1, fileSize, saveFile);
+  fclose(saveFile);
+  PostReceivedFile(state, peer->name, type, savePath, name,
+                   hashed ? digest : NULL);
+}
+
+// Waits for file data still being written through io_uring; false if any of
+// it failed to land
+static bool FlushTransferFile(Peer *peer) {
+  return !peer->ring || Uring_Drain(peer->ring);
+}
+
+static void ResetFileTransfer(Peer *peer) {
+  FileTransfer *ft = &peer->transfer;
+  if (ft->file) {
+    FlushTransferFile(peer);
+    fclose(ft->file);
   }
+  if (ft->file || ft->suspended)
+    remove(ft->partPath);
+  Hash_End(ft->hash, NULL);
+  memset(ft, 0, sizeof(*ft));
+}
 
-  const char *filename = strrchr(filepath, '/');
-  filename = filename ? filename + 1 : filepath;
-  uint32_t nameLen = strlen(filename);
+// Keeps the part file and hash of a transfer the connection dropped in the
+// middle of, for the sender to resume
+static void SuspendFileTransfer(Peer *peer) {
+  FileTransfer *ft = &peer->transfer;
+  if (!FlushTransferFile(peer)) {
+    ResetFileTransfer(peer); // What it holds is not what was received
+    return;
+  }
+  fclose(ft->file);
+  ft->file = NULL;
+  ft->isReceiving = false;
+  ft->suspended = true;
+  LOG_INFO("Keeping %llu bytes of %s to resume",
+           (unsigned long long)ft->received, ft->filename);
+}
 
-  uint32_t netNameLen = htonl(nameLen);
-  uint32_t netFileSize = htonl((uint32_t)fileSize); // Assuming < 4GB
+static void SendFileResume(Peer *peer, uint64_t id, uint64_t offset) {
+  unsigned char payload[16];
+  PutBE64(payload, id);
+  PutBE64(payload + 8, offset);
+  SendFramedMessage(peer, MSG_FILE_RESUME, payload, sizeof(payload));
+}
 
-  size_t payloadLen = sizeof(uint32_t) + nameLen + sizeof(uint32_t) + fileSize;
-  unsigned char *payload = (unsigned char *)malloc(payloadLen);
-  if (!payload) {
-    free(fileData);
-    ShowStatus(state, "Memory allocation failed");
+// Asks the sender to go back to what we hold; chunks are dropped until then
+static void RequestResume(Peer *peer, FileTransfer *ft) {
+  SendFileResume(peer, ft->id, ft->received);
+  ft->resumeRequested = true;
+  ft->resumes++;
+}
+
+// Refuses the transfer the peer is sending; its remaining chunks are dropped
+// as strays
+static void RejectFileTransfer(Peer *peer, FileTransfer *ft, uint64_t id) {
+  ResetFileTransfer(peer);
+  unsigned char payload[8];
+  PutBE64(payload, id);
+  SendFramedMessage(peer, MSG_FILE_REJECT, payload, id ? sizeof(payload) : 0);
+}
+
+// Receive threads share the list of finished transfers under peerMutex
+static bool FinishedTransfer(AppState *state, uint64_t id) {
+  bool finished = false;
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < 8; i++)
+    if (state->finishedTransfers[i] == id)
+      finished = true;
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  return finished;
+}
+
+// True when the chat line with this ID was shown already; otherwise notes
+// it. Called with messageMutex held.
+static bool SeenMessage(AppState *state, uint64_t id) {
+  for (int i = 0; i < SEEN_MESSAGES; i++)
+    if (state->seenMessages[i] == id)
+      return true;
+  state->seenMessages[state->seenNext] = id;
+  state->seenNext = (state->seenNext + 1) % SEEN_MESSAGES;
+  return false;
+}
+
+static void NoteFinishedTransfer(AppState *state, uint64_t id) {
+  pthread_mutex_lock(&state->connection.peerMutex);
+  state->finishedTransfers[state->finishedNext] = id;
+  state->finishedNext = (state->finishedNext + 1) % 8;
+  pthread_mutex_unlock(&state->connection.peerMutex);
+}
+
+// Picks a suspended transfer back up if the header offers the same file
+static bool ResumeFileTransfer(Peer *peer, FileTransfer *ft, uint64_t id,
+                               MessageType type, uint64_t size) {
+  if (!ft->suspended || ft->id != id || ft->fileType != type ||
+      ft->size != size)
+    return false;
+  // Anything past received was never counted; cut it before carrying on.
+  // Not opened for appending: writes through io_uring give their offsets.
+  if (truncate(ft->partPath, (off_t)ft->received) != 0 ||
+      !(ft->file = fopen(ft->partPath, "r+b")))
+    return false;
+  if (fseek(ft->file, 0, SEEK_END) != 0) {
+    fclose(ft->file);
+    ft->file = NULL;
+    return false;
+  }
+  ft->suspended = false;
+  ft->isReceiving = true;
+  ft->resumes = 0;
+  if (ft->received > 0)
+    RequestResume(peer, ft);
+  LOG_INFO("Resuming %s at %llu bytes", ft->filename,
+           (unsigned long long)ft->received);
+  ShowStatus(peer->app, "Resuming file transfer...");
+  return true;
+}
+
+// MSG_FILE_BEGIN: everything that can be refused is checked here, before any
+// file data is sent or stored
+static void BeginFileTransfer(Peer *peer, const unsigned char *data,
+                              size_t len) {
+  AppState *state = peer->app;
+  FileTransfer *ft = &peer->transfer;
+  uint32_t nameLen = 0;
+  if (len >= 5) {
+    uint32_t netNameLen;
+    memcpy(&netNameLen, data + 1, 4);
+    nameLen = ntohl(netNameLen);
+  }
+  if (len < 5 || len != 5 + (size_t)nameLen + 16 ||
+      (data[0] != MSG_IMAGE && data[0] != MSG_AUDIO)) {
+    LOG_WARN("Malformed transfer header (%zu bytes)", len);
+    RejectFileTransfer(peer, ft, 0);
+    return;
+  }
+  MessageType type = (MessageType)data[0];
+  uint64_t size = GetBE64(data + 5 + nameLen);
+  uint64_t id = GetBE64(data + 5 + nameLen + 8);
+  char filename[256];
+  if (!AcceptFileName(state, type, data + 5, nameLen, filename)) {
+    RejectFileTransfer(peer, ft, id);
+    return;
+  }
+  if (FinishedTransfer(state, id)) {
+    // Our confirmation was lost with the last connection
+    SendFileResume(peer, id, size);
     return;
   }
+  if (strcmp(filename, ft->filename) == 0 &&
+      ResumeFileTransfer(peer, ft, id, type, size))
+    return;
+  ResetFileTransfer(peer);
+  memcpy(ft->filename, filename, sizeof(ft->filename));
 
-  size_t offset = 0;
-  memcpy(payload + offset, &netNameLen, sizeof(uint32_t));
-  offset += sizeof(uint32_t);
-  memcpy(payload + offset, filename, nameLen);
-  offset += nameLen;
-  memcpy(payload + offset, &netFileSize, sizeof(uint32_t));
-  offset += sizeof(uint32_t);
-  memcpy(payload + offset, fileData, fileSize);
-  offset += fileSize;
+  struct statvfs fs;
+  if (statvfs(".", &fs) == 0 &&
+      (uint64_t)fs.f_bavail * fs.f_frsize < size) {
+    LOG_WARN("Refusing %s: %llu bytes, not enough disk space", ft->filename,
+             (unsigned long long)size);
+    ShowStatus(state, "Rejected received file: not enough disk space");
+    RejectFileTransfer(peer, ft, id);
+    return;
+  }
 
-  SendFramedMessage(state, type, payload, payloadLen);
+  char name[272];
+  SavedName(peer, ft->filename, name, sizeof(name));
+  snprintf(ft->partPath, sizeof(ft->partPath), "received_%s.part", name);
+  ft->file = fopen(ft->partPath, "wb");
+  ft->hash = Hash_Begin();
+  if (!ft->file || !ft->hash) {
+    ShowStatus(state, "Rejected received file: cannot save it");
+    RejectFileTransfer(peer, ft, id);
+    return;
+  }
+  ft->fileType = type;
+  ft->id = id;
+  ft->size = size;
+  ft->received = 0;
+  ft->isReceiving = true;
+}
 
-  free(payload);
-  free(fileData);
+// A slice of file data. Only the one continuing what we hold is taken; on a
+// gap, left by a chunk dropped for a bad CRC or a resume in flight, the sender
+// is asked once to go back to where we are.
+static void ContinueFileTransfer(Peer *peer, const unsigned char *data,
+                                 size_t len) {
+  AppState *state = peer->app;
+  FileTransfer *ft = &peer->transfer;
+  if (len < 8) {
+    LOG_WARN("Malformed chunk of %s", ft->filename);
+    RejectFileTransfer(peer, ft, ft->id);
+    return;
+  }
+  uint64_t offset = GetBE64(data);
+  data += 8;
+  len -= 8;
+  if (offset != ft->received) {
+    if (!ft->resumeRequested) {
+      LOG_INFO("Chunk of %s at %llu, expected %llu; asking to resume",
+               ft->filename, (unsigned long long)offset,
+               (unsigned long long)ft->received);
+      RequestResume(peer, ft);
+    }
+    return;
+  }
+  ft->resumeRequested = false;
+  if (len > ft->size - ft->received) {
+    LOG_WARN("Transfer of %s overran its declared size", ft->filename);
+    RejectFileTransfer(peer, ft, ft->id);
+    return;
+  }
+  bool written = peer->ring ? Uring_Write(peer->ring, fileno(ft->file),
+                                          ft->received, data, len)
+                            : fwrite(data, 1, len, ft->file) == len;
+  if (!written) {
+    ShowStatus(state, "Rejected received file: write failed");
+    RejectFileTransfer(peer, ft, ft->id);
+    return;
+  }
+  Hash_Update(ft->hash, data, len);
+  ft->received += len;
+}
 
-  if (strcmp(actualFilePath, filepath) != 0) {
-    remove(actualFilePath);
+static void FinishFileTransfer(Peer *peer, const unsigned char *data,
+                               size_t len) {
+  AppState *state = peer->app;
+  FileTransfer *ft = &peer->transfer;
+  if (!ft->isReceiving)
+    return; // End of a refused or already finished transfer
+  if (len == 0) {
+    ShowStatus(state, "Sender cancelled the file transfer");
+    ResetFileTransfer(peer);
+    return;
+  }
+  if (len != HASH_LEN + 4) {
+    LOG_WARN("Malformed end of %s", ft->filename);
+    RejectFileTransfer(peer, ft, ft->id);
+    return;
+  }
+  if (ft->received < ft->size) {
+    // The tail went missing. Unless a request of ours is still on its way,
+    // the sender went through with every one: ask again.
+    uint32_t netResumes;
+    memcpy(&netResumes, data + HASH_LEN, 4);
+    if (ntohl(netResumes) == ft->resumes)
+      RequestResume(peer, ft);
+    return;
   }
 
-  char msg[512];
-  sprintf(msg, "[%s] %s", type == MSG_IMAGE ? "Image" : "Audio", filename);
-  AddMessage(state, "You", msg, type, true);
+  unsigned char digest[HASH_LEN];
+  bool hashed = Hash_End(ft->hash, digest);
+  ft->hash = NULL;
+  bool closed = FlushTransferFile(peer);
+  closed = fclose(ft->file) == 0 && closed;
+  ft->file = NULL;
+  uint64_t id = ft->id;
 
-  if (strlen(state->hiddenMessageBuffer) > 0) {
-    ShowStatus(state, "File sent with hidden message!");
-    state->hiddenMessageBuffer[0] = '\0';
+  if (!hashed || !closed || !Hash_Equal(digest, data)) {
+    LOG_WARN("Content hash mismatch for %s (%llu bytes)", ft->filename,
+             (unsigned long long)ft->received);
+    ShowStatus(state, "Rejected received file: hash mismatch");
   } else {
-    ShowStatus(state, "File sent!");
+    char name[272], savePath[288];
+    SavedName(peer, ft->filename, name, sizeof(name));
+    snprintf(savePath, sizeof(savePath), "received_%s", name);
+    if (rename(ft->partPath, savePath) == 0) {
+      NoteFinishedTransfer(state, id);
+      SendFileResume(peer, id, ft->size);
+      PostReceivedFile(state, peer->name, ft->fileType, savePath, name,
+                       digest);
+      memset(ft, 0, sizeof(*ft));
+      return;
+    }
   }
+  remove(ft->partPath);
+  memset(ft, 0, sizeof(*ft));
+  unsigned char payload[8];
+  PutBE64(payload, id);
+  SendFramedMessage(peer, MSG_FILE_REJECT, payload, sizeof(payload));
+}
+
+// Hands the peer's verdict on one of our transfers to the writer
+static void NoteFileFeedback(Peer *peer, MessageType type,
+                             const unsigned char *data, size_t len) {
+  SendQueue *q = peer->sendQueue;
+  bool resume = type == MSG_FILE_RESUME;
+  if (!q || (resume ? len != 16 : len != 0 && len != 8))
+    return;
+  struct iovec part = {(void *)data, len};
+  SendQueue_Push(q, SEND_PRIO_CONTROL,
+                 resume ? NOTE_FILE_RESUME : NOTE_FILE_REJECT, &part, 1, -1);
+}
+
+// Handles one received frame; false drops the connection
+static bool DispatchFrame(Peer *peer, const unsigned char *payload,
+                          uint32_t totalLen) {
+  AppState *state = peer->app;
+  Transport *t = peer->transport;
+  unsigned char typeByte = payload[0];
+  size_t payloadBytes = totalLen - 1;
+  const unsigned char *data = payload + 1;
+
+  if (typeByte & FRAME_FLAG_CRC) {
+    if (payloadBytes < 4)
+      return false;
+    payloadBytes -= 4;
+    uint32_t netCrc;
+    memcpy(&netCrc, data + payloadBytes, 4);
+    if (Crypto_CRC32C(payload, 1 + payloadBytes) != ntohl(netCrc)) {
+      LOG_WARN("Dropping frame with bad CRC32C (type %u, %u bytes)",
+               typeByte & ~FRAME_FLAG_CRC, totalLen);
+      ShowStatus(state, "Dropped corrupted frame");
+      return true;
+    }
+  }
+  MessageType type = (MessageType)(typeByte & ~FRAME_FLAG_CRC);
+
+  // The hello opens the link, once; anything before it skipped the key
+  // exchange, and a later one would reset the receive key
+  if (!t->helloSeen && type != MSG_HELLO) {
+    LOG_WARN("Peer sent frame type %d before its hello", type);
+    ShowStatus(state, "Peer skipped the handshake");
+    return false;
+  }
+  if (type == MSG_HELLO) {
+    if (!Transport_AcceptHello(t, ReceiveKey(state), data, payloadBytes)) {
+      LOG_WARN("Peer hello rejected (%zu bytes)", payloadBytes);
+      if (t->txArmed && payloadBytes >= 2 &&
+          !(data[1] & TRANSPORT_HELLO_ENCRYPTED))
+        ShowStatus(state, "Peer does not encrypt the connection");
+      else
+        ShowStatus(state, "Peer encrypts the connection - set the same key");
+      return false;
+    }
+    int cipher = Transport_Cipher(t);
+    if (cipher)
+      LOG_INFO("Sealing connection frames with %s",
+               Crypto_CipherName(cipher));
+    else if (!t->ssl)
+      LOG_INFO("Sending connection frames in cleartext");
+  } else if (type == MSG_PING) {
+    // Echoed as is; older peers send empty pings
+    SendFramedMessage(peer, MSG_PONG, data,
+                      payloadBytes == PING_PAYLOAD_LEN ? payloadBytes : 0);
+  } else if (type == MSG_PONG) {
+    atomic_store(&peer->unansweredSinceNs, 0);
+    if (payloadBytes == PING_PAYLOAD_LEN) {
+      uint64_t seq = GetBE64(data);
+      uint64_t sentNs = GetBE64(data + 8);
+      // Only the first pong to a ping still in the window is timed
+      uint_fast64_t expected = sentNs;
+      uint64_t now = MonotonicNs();
+      if (sentNs != 0 && sentNs <= now &&
+          atomic_compare_exchange_strong(
+              &peer->pingSentNs[seq % PING_WINDOW], &expected, 0))
+        Histogram_Record(&peer->rtt, now - sentNs);
+    }
+  } else if (type == MSG_TEXT) {
+    if (payloadBytes >= 4) {
+      uint32_t netStrLen;
+      memcpy(&netStrLen, data, 4);
+      uint32_t strLen = ntohl(netStrLen);
+
+      if (strLen > 0 && strLen <= MAX_MESSAGE_LENGTH &&
+          payloadBytes >= 4 + strLen) {
+        char message[MAX_MESSAGE_LENGTH + 1];
+        memcpy(message, data + 4, strLen);
+        message[strLen] = '\0';
+        size_t len = 4 + strLen;
+        uint64_t id = 0;
+        if (payloadBytes >= len + TEXT_ID_LEN) {
+          id = GetBE64(data + len);
+          len += TEXT_ID_LEN;
+        }
+
+        pthread_mutex_lock(&state->messageMutex);
+        bool repeat = id != 0 && SeenMessage(state, id);
+        if (!repeat)
+          AddMessage(state, peer->name, message, MSG_TEXT, false);
+        pthread_mutex_unlock(&state->messageMutex);
+        // A server passes it on to its other peers, so they all share a room
+        if (!repeat)
+          Broadcast(state, peer, MSG_TEXT, data, len);
+        else
+          LOG_INFO("Dropping repeated message %016llx from %s",
+                   (unsigned long long)id, peer->remoteIP);
+      }
+    }
+  } else if (type == MSG_IMAGE || type == MSG_AUDIO) {
+    ReceiveFile(peer, type, data, payloadBytes);
+  } else if (type == MSG_FILE_BEGIN) {
+    BeginFileTransfer(peer, data, payloadBytes);
+  } else if (type == MSG_FILE_CHUNK) {
+    // Strays from a refused or finished transfer are dropped
+    if (peer->transfer.isReceiving)
+      ContinueFileTransfer(peer, data, payloadBytes);
+  } else if (type == MSG_FILE_END) {
+    FinishFileTransfer(peer, data, payloadBytes);
+  } else if (type == MSG_FILE_REJECT || type == MSG_FILE_RESUME) {
+    NoteFileFeedback(peer, type, data, payloadBytes);
+  }
+  return true;
 }
 
 void *ReceiveMessages(void *arg) {
-  AppState *state = (AppState *)arg;
+  Peer *peer = (Peer *)arg;
+  AppState *state = peer->app;
+  Transport *t = peer->transport;
 
-  while (state->connection.isConnected && state->connection.threadActive) {
-    uint32_t netLen = 0;
+  // Frames are parsed where the transport holds them; only one that is split
+  // across its buffers is copied out, into a pooled buffer
+  BufPool pool = {0};
+
+  if (state->useUring && (peer->ring = Uring_Create())) {
+    if (Transport_UseRing(t, peer->ring))
+      LOG_INFO("Receiving from %s through io_uring", peer->remoteIP);
+  } else if (state->useUring) {
+    LOG_INFO("io_uring unavailable; receiving with recv(2)");
+  }
+
+  while (peer->isConnected && peer->threadActive) {
+    unsigned char lenBuf[4];
+    const unsigned char *view;
 
     // Attempt to receive 4-byte length prefix
-    ssize_t lenRead =
-        recv(state->connection.socket_fd, &netLen, 4, MSG_WAITALL);
-    if (lenRead < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        continue; // Timeout, loop again
-      }
-      if (state->connection.isConnected)
-        ShowStatus(state, "Connection lost");
-      break;
-    } else if (lenRead == 0) {
-      if (state->connection.isConnected)
-        ShowStatus(state, "Connection closed by peer");
-      break;
-    } else if (lenRead != 4) {
-      // Incomplete read of length header
+    TransportStatus st = Transport_RecvView(t, lenBuf, 4, true, &view);
+    if (st == TRANSPORT_TIMEOUT)
+      continue; // Interrupted; recheck the flags
+    if (st != TRANSPORT_OK) {
+      if (peer->isConnected)
+        ShowStatus(state, TransportStatusText(st));
       break;
     }
 
+    uint32_t netLen;
+    memcpy(&netLen, view, 4);
     uint32_t totalLen = ntohl(netLen);
-    if (totalLen == 0 || totalLen > 15 * 1024 * 1024) { // Absolute max 15MB
+    if (totalLen == 0 || totalLen > MAX_FRAME_BYTES) {
       // Invalid or overly large msg
       break;
     }
 
-    unsigned char *payload = (unsigned char *)malloc(totalLen);
-    if (!payload)
+    unsigned char *scratch = BufPool_Get(&pool, totalLen);
+    if (!scratch)
       break;
-
-    if (!RecvAll(state->connection.socket_fd, payload, totalLen)) {
-      free(payload);
+    const unsigned char *payload;
+    st = Transport_RecvView(t, scratch, totalLen, false, &payload);
+    if (st != TRANSPORT_OK) {
+      BufPool_Put(&pool, scratch, totalLen);
+      if (peer->isConnected)
+        ShowStatus(state, TransportStatusText(st));
       break;
     }
-
-    MessageType type = (MessageType)payload[0];
-    size_t payloadBytes = totalLen - 1;
-    unsigned char *data = payload + 1;
-
-    if (type == MSG_PING) {
-      SendFramedMessage(state, MSG_PONG, NULL, 0);
-    } else if (type == MSG_PONG) {
-      state->connection.lastPongReceived = GetTime();
-      state->connection.latency = (state->connection.lastPongReceived -
-                                   state->connection.lastPingSent) *
-                                  1000.0f; // in ms
-    } else if (type == MSG_TEXT) {
-      if (payloadBytes >= 4) {
-        uint32_t netStrLen;
-        memcpy(&netStrLen, data, 4);
-        uint32_t strLen = ntohl(netStrLen);
-
-        if (strLen > 0 && strLen <= MAX_MESSAGE_LENGTH &&
-            payloadBytes >= 4 + strLen) {
-          char *message = (char *)malloc(strLen + 1);
-          memcpy(message, data + 4, strLen);
-          message[strLen] = '\0';
-
-          pthread_mutex_lock(&state->messageMutex);
-          AddMessage(state, "Contact", message, MSG_TEXT, false);
-          pthread_mutex_unlock(&state->messageMutex);
-          free(message);
-        }
-      }
-    } else if (type == MSG_IMAGE || type == MSG_AUDIO) {
-      if (payloadBytes >= 8) {
-        uint32_t netNameLen;
-        memcpy(&netNameLen, data, 4);
-        uint32_t nameLen = ntohl(netNameLen);
-
-        if (payloadBytes >= 4 + nameLen + 4) {
-          char filename[256] = {0};
-          size_t cpyLen = (nameLen < 255) ? nameLen : 255;
-          memcpy(filename, data + 4, cpyLen);
-
-          // Sanitize filename: replace path separators and ".." components
-          for (size_t k = 0; k < cpyLen; k++) {
-            if (filename[k] == '/' || filename[k] == '\\') {
-              filename[k] = '_';
-            }
-          }
-          char *dotdot = strstr(filename, "..");
-          while (dotdot) {
-            dotdot[0] = '_';
-            dotdot[1] = '_';
-            dotdot = strstr(filename, "..");
-          }
-
-          uint32_t netFileSize;
-          memcpy(&netFileSize, data + 4 + nameLen, 4);
-          uint32_t fileSize = ntohl(netFileSize);
-
-          bool validExt = false;
-          char *ext = strrchr(filename, '.');
-          if (ext) {
-            if (type == MSG_IMAGE &&
-                (strcasecmp(ext, ".png") == 0 || strcasecmp(ext, ".jpg") == 0 ||
-                 strcasecmp(ext, ".jpeg") == 0))
-              validExt = true;
-            else if (type == MSG_AUDIO && (strcasecmp(ext, ".wav") == 0 ||
-                                           strcasecmp(ext, ".mp3") == 0 ||
-                                           strcasecmp(ext, ".ogg") == 0))
-              validExt = true;
-          }
-          if (!validExt) {
-            ShowStatus(state, "Rejected received file: Untrusted extension");
-            continue; // Skip processing this packet payload
-          }
-
-          if (payloadBytes >= 4 + nameLen + 4 + fileSize &&
-              fileSize <= 10 * 1024 * 1024) {
-            char savePath[512];
-            sprintf(savePath, "received_%s", filename);
-            FILE *saveFile = fopen(savePath, "wb");
-            if (saveFile) {
-              fwrite(data + 4 + nameLen + 4, 1, fileSize, saveFile);
-              fclose(saveFile);
-
-              char *hiddenMsg = NULL;
-              if (type == MSG_IMAGE) {
-                hiddenMsg = DecodeMessageFromImage(state, savePath);
-              } else if (type == MSG_AUDIO) {
-                hiddenMsg = DecodeMessageFromAudio(state, savePath);
-              }
-
-              pthread_mutex_lock(&state->messageMutex);
-              char msg[512];
-              sprintf(msg, "[%s] %s", type == MSG_IMAGE ? "Image" : "Audio",
-                      filename);
-              AddMessage(state, "Contact", msg, type, false);
-
-              if (hiddenMsg && strlen(hiddenMsg) > 0) {
-                state->messages[state->messageCount - 1].hasHiddenMessage =
-                    true;
-                strncpy(state->messages[state->messageCount - 1].hiddenMessage,
-                        hiddenMsg,
-                        sizeof(state->messages[state->messageCount - 1]
-                                   .hiddenMessage) -
-                            1);
-                state->messages[state->messageCount - 1]
-                    .hiddenMessage[sizeof(
-                                       state->messages[state->messageCount - 1]
-                                           .hiddenMessage) -
-                                   1] = '\0';
-                free(hiddenMsg);
-              }
-              pthread_mutex_unlock(&state->messageMutex);
-            }
-          }
-        }
-      }
+    MessageType type = (MessageType)(payload[0] & ~FRAME_FLAG_CRC);
+    bool keep = DispatchFrame(peer, payload, totalLen);
+    BufPool_Put(&pool, scratch, totalLen);
+    // The kernel drops quick ACKs again on its own, so they are rearmed
+    // after every frame the peer may be waiting to hear back about
+    if (state->tuning.quickAck && FramePriority(type) != SEND_PRIO_BULK) {
+      int one = 1;
+      setsockopt(peer->socket_fd, IPPROTO_TCP, TCP_QUICKACK, &one,
+                 sizeof(one));
     }
-
-    free(payload);
+    if (!keep)
+      break;
   }
 
-  state->connection.isConnected = false;
+  BufPool_Clear(&pool);
+  uint64_t pongs = Histogram_Count(&peer->rtt);
+  if (pongs > 0)
+    LOG_INFO("Round trips to %s: %llu of %llu pings answered, p50 %.3f ms, "
+             "p99 %.3f ms, max %.3f ms",
+             peer->remoteIP, (unsigned long long)pongs,
+             (unsigned long long)atomic_load(&peer->pingSeq),
+             Histogram_Percentile(&peer->rtt, 0.50) / 1e6,
+             Histogram_Percentile(&peer->rtt, 0.99) / 1e6,
+             Histogram_Max(&peer->rtt) / 1e6);
+  FileTransfer *ft = &peer->transfer;
+  if (ft->isReceiving)
+    SuspendFileTransfer(peer);
+  else if (!ft->suspended)
+    ResetFileTransfer(peer);
+  Transport_UseRing(t, NULL);
+  Uring_Destroy(peer->ring);
+  peer->ring = NULL;
+  Transport_Close(t);
+  pthread_mutex_lock(&state->connection.peerMutex);
+  peer->isConnected = false;
+  CountPeers(state);
+  pthread_mutex_unlock(&state->connection.peerMutex);
+  if (state->connection.redial) {
+    uint64_t one = 1;
+    ssize_t signalled = write(state->connection.linkDownFd, &one, sizeof(one));
+    (void)signalled;
+  }
   return NULL;
 }
 
@@ -471,5 +2074,30 @@ void SendPing(AppState *state) {
   if (!state->connection.isConnected)
     return;
   state->connection.lastPingSent = GetTime();
-  SendFramedMessage(state, MSG_PING, NULL, 0);
+  pthread_mutex_lock(&state->connection.peerMutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    Peer *peer = &state->connection.peers[i];
+    if (!peer->isConnected)
+      continue;
+    // A peer gone without a FIN or RST leaves the socket open for good;
+    // cutting it ends the receive thread, so a client redials
+    uint64_t now = MonotonicNs();
+    uint_fast64_t since = 0;
+    if (!atomic_compare_exchange_strong(&peer->unansweredSinceNs, &since,
+                                        now) &&
+        now - since >= (uint64_t)PING_TIMEOUT_SEC * 1000000000) {
+      LOG_WARN("No pong from %s in %d s; dropping the link", peer->remoteIP,
+               PING_TIMEOUT_SEC);
+      shutdown(peer->socket_fd, SHUT_RDWR);
+      continue;
+    }
+    // Taking the slot gives up on whatever ping held it PING_WINDOW ago
+    uint64_t seq = atomic_fetch_add(&peer->pingSeq, 1);
+    unsigned char ping[PING_PAYLOAD_LEN];
+    PutBE64(ping, seq);
+    PutBE64(ping + 8, now);
+    atomic_store(&peer->pingSentNs[seq % PING_WINDOW], now);
+    SendFramedMessage(peer, MSG_PING, ping, sizeof(ping));
+  }
+  pthread_mutex_unlock(&state->connection.peerMutex);
 }
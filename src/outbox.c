@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "logging.h"
+#include "outbox.h"
+
+#define RECORD_HEADER 13
+#define KIND_QUEUED 'Q'
+#define KIND_SENT 'S'
+
+static void PutBE32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (unsigned char)(v >> (24 - 8 * i));
+}
+
+static uint32_t GetBE32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void PutBE64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+static uint64_t GetBE64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static bool WriteAll(int fd, const unsigned char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Adds one record to the journal and wakes the journal thread. Called with
+// journalLock held.
+static bool Journal(Outbox *o, char kind, uint64_t id, const char *text,
+                    uint32_t len) {
+  size_t need = o->journalLen + RECORD_HEADER + len;
+  if (need > o->journalCap) {
+    size_t cap = o->journalCap ? o->journalCap * 2 : 4096;
+    while (cap < need)
+      cap *= 2;
+    unsigned char *grown = realloc(o->journal, cap);
+    if (!grown)
+      return false;
+    o->journal = grown;
+    o->journalCap = cap;
+  }
+  unsigned char *record = o->journal + o->journalLen;
+  record[0] = (unsigned char)kind;
+  PutBE64(record + 1, id);
+  PutBE32(record + 9, len);
+  if (len > 0)
+    memcpy(record + RECORD_HEADER, text, len);
+  o->journalLen = need;
+  pthread_cond_signal(&o->journalWake);
+  return true;
+}
+
+// Appends records and waits for them to reach the disk. Records that only
+// partly made it are cut off again, so the log stays parseable.
+static void WriteRecords(Outbox *o, const unsigned char *records, size_t len,
+                         bool truncate) {
+  if (truncate && ftruncate(o->fd, 0) != 0)
+    LOG_WARN("Cannot empty outbox: %s", strerror(errno));
+  if (len == 0)
+    return;
+  struct stat st;
+  if (fstat(o->fd, &st) != 0) {
+    LOG_WARN("Cannot write outbox: %s", strerror(errno));
+    return;
+  }
+  if (WriteAll(o->fd, records, len) && fdatasync(o->fd) == 0)
+    return;
+  LOG_WARN("Cannot write outbox: %s", strerror(errno));
+  if (ftruncate(o->fd, st.st_size) != 0)
+    LOG_WARN("Outbox may end in a torn record: %s", strerror(errno));
+}
+
+static void DropAt(Outbox *o, int i) {
+  free(o->pending[i].text);
+  o->count--;
+  memmove(o->pending + i, o->pending + i + 1,
+          (o->count - i) * sizeof(OutboxEntry));
+  if (i < o->queued)
+    o->queued--;
+}
+
+static int FindPending(const Outbox *o, uint64_t id) {
+  for (int i = 0; i < o->count; i++)
+    if (o->pending[i].id == id)
+      return i;
+  return -1;
+}
+
+// Drops the lines writer threads have sent, and journals that they were
+static void DropWritten(Outbox *o, const uint64_t *ids, size_t n) {
+  pthread_mutex_lock(&o->lock);
+  pthread_mutex_lock(&o->journalLock);
+  for (size_t k = 0; k < n; k++) {
+    // Lines sent to several peers come back once per peer
+    int i = FindPending(o, ids[k]);
+    if (i < 0)
+      continue;
+    DropAt(o, i);
+    if (o->count == 0) {
+      // Nothing left to replay, so the log starts over
+      o->journalLen = 0;
+      o->truncate = true;
+    } else if (!Journal(o, KIND_SENT, ids[k], NULL, 0)) {
+      LOG_WARN("Cannot journal a sent message; it may go out again");
+    }
+  }
+  pthread_mutex_unlock(&o->journalLock);
+  pthread_mutex_unlock(&o->lock);
+}
+
+static void *JournalThread(void *arg) {
+  Outbox *o = (Outbox *)arg;
+  pthread_mutex_lock(&o->journalLock);
+  for (;;) {
+    while (!o->journalLen && !o->truncate && !o->writtenCount && !o->stopping)
+      pthread_cond_wait(&o->journalWake, &o->journalLock);
+    if (o->writtenCount) {
+      uint64_t *ids = o->written;
+      size_t n = o->writtenCount;
+      o->written = NULL;
+      o->writtenCount = o->writtenCap = 0;
+      pthread_mutex_unlock(&o->journalLock);
+      DropWritten(o, ids, n);
+      free(ids);
+      pthread_mutex_lock(&o->journalLock);
+    }
+    if (!o->journalLen && !o->truncate) {
+      if (o->stopping && !o->writtenCount)
+        break;
+      continue;
+    }
+    unsigned char *records = o->journal;
+    size_t len = o->journalLen;
+    bool truncate = o->truncate;
+    o->journal = NULL;
+    o->journalLen = o->journalCap = 0;
+    o->truncate = false;
+    pthread_mutex_unlock(&o->journalLock);
+    WriteRecords(o, records, len, truncate);
+    free(records);
+    pthread_mutex_lock(&o->journalLock);
+  }
+  pthread_mutex_unlock(&o->journalLock);
+  return NULL;
+}
+
+// Rebuilds the pending list from the log and returns how many bytes of it
+// parsed
+static size_t Replay(Outbox *o, const unsigned char *log, size_t len) {
+  size_t pos = 0;
+  while (len - pos >= RECORD_HEADER) {
+    const unsigned char *rec = log + pos;
+    uint64_t id = GetBE64(rec + 1);
+    uint32_t textLen = GetBE32(rec + 9);
+    if (textLen > MAX_MESSAGE_LENGTH || len - pos - RECORD_HEADER < textLen)
+      break;
+    if (rec[0] == KIND_QUEUED && o->count < OUTBOX_MAX_PENDING) {
+      char *text = malloc(textLen + 1);
+      if (!text)
+        break;
+      memcpy(text, rec + RECORD_HEADER, textLen);
+      text[textLen] = '\0';
+      o->pending[o->count++] = (OutboxEntry){id, text};
+    } else if (rec[0] == KIND_SENT) {
+      int i = FindPending(o, id);
+      if (i >= 0)
+        DropAt(o, i);
+    } else if (rec[0] != KIND_QUEUED) {
+      break;
+    }
+    pos += RECORD_HEADER + textLen;
+  }
+  return pos;
+}
+
+Outbox *Outbox_Open(const char *path) {
+  Outbox *o = calloc(1, sizeof(Outbox));
+  if (!o)
+    return NULL;
+  o->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  struct stat st;
+  if (o->fd < 0 || fstat(o->fd, &st) != 0) {
+    LOG_WARN("Cannot open outbox %s: %s", path, strerror(errno));
+    if (o->fd >= 0)
+      close(o->fd);
+    free(o);
+    return NULL;
+  }
+  size_t len = (size_t)st.st_size;
+  unsigned char *log = malloc(len ? len : 1);
+  size_t got = 0;
+  while (log && got < len) {
+    ssize_t n = pread(o->fd, log + got, len - got, (off_t)got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  size_t parsed = log ? Replay(o, log, got) : 0;
+  free(log);
+  if (o->count == 0)
+    parsed = 0;
+  if (parsed < len && ftruncate(o->fd, (off_t)parsed) != 0)
+    LOG_WARN("Cannot trim outbox %s: %s", path, strerror(errno));
+  if (o->count > 0)
+    LOG_INFO("Outbox holds %d unsent messages", o->count);
+  pthread_mutex_init(&o->lock, NULL);
+  pthread_mutex_init(&o->journalLock, NULL);
+  pthread_cond_init(&o->journalWake, NULL);
+  if (pthread_create(&o->journalThread, NULL, JournalThread, o) != 0) {
+    LOG_WARN("Cannot start the outbox journal thread");
+    o->stopping = true; // So Outbox_Close does not wait for it
+    Outbox_Close(o);
+    return NULL;
+  }
+  return o;
+}
+
+void Outbox_Close(Outbox *o) {
+  if (!o)
+    return;
+  pthread_mutex_lock(&o->journalLock);
+  bool running = !o->stopping;
+  o->stopping = true;
+  pthread_cond_signal(&o->journalWake);
+  pthread_mutex_unlock(&o->journalLock);
+  if (running)
+    pthread_join(o->journalThread, NULL);
+  while (o->count > 0)
+    DropAt(o, 0);
+  free(o->journal);
+  free(o->written);
+  close(o->fd);
+  pthread_cond_destroy(&o->journalWake);
+  pthread_mutex_destroy(&o->journalLock);
+  pthread_mutex_destroy(&o->lock);
+  free(o);
+}
+
+int Outbox_Pending(Outbox *o) {
+  pthread_mutex_lock(&o->lock);
+  int count = o->count;
+  pthread_mutex_unlock(&o->lock);
+  return count;
+}
+
+void Outbox_MarkSent(Outbox *o, uint64_t id) {
+  pthread_mutex_lock(&o->journalLock);
+  if (o->writtenCount == o->writtenCap) {
+    size_t cap = o->writtenCap ? o->writtenCap * 2 : 16;
+    uint64_t *grown = realloc(o->written, cap * sizeof(uint64_t));
+    if (!grown) {
+      // It stays pending and goes out again on the next link
+      pthread_mutex_unlock(&o->journalLock);
+      return;
+    }
+    o->written = grown;
+    o->writtenCap = cap;
+  }
+  o->written[o->writtenCount++] = id;
+  pthread_cond_signal(&o->journalWake);
+  pthread_mutex_unlock(&o->journalLock);
+}
+
+bool Outbox_Append(Outbox *o, uint64_t id, const char *text) {
+  if (o->count == OUTBOX_MAX_PENDING)
+    return false;
+  uint32_t len = strnlen(text, MAX_MESSAGE_LENGTH);
+  char *copy = malloc(len + 1);
+  if (!copy)
+    return false;
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  pthread_mutex_lock(&o->journalLock);
+  bool journaled = Journal(o, KIND_QUEUED, id, copy, len);
+  pthread_mutex_unlock(&o->journalLock);
+  if (!journaled) {
+    free(copy);
+    return false;
+  }
+  o->pending[o->count++] = (OutboxEntry){id, copy};
+  return true;
+}
@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sendqueue.h"
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+SendShared *SendShared_Create(size_t len) {
+  SendShared *shared = malloc(sizeof(SendShared) + len);
+  if (!shared)
+    return NULL;
+  atomic_init(&shared->refs, 1);
+  shared->len = len;
+  shared->data = (unsigned char *)(shared + 1);
+  return shared;
+}
+
+SendShared *SendShared_Adopt(void *data, size_t len) {
+  SendShared *shared = malloc(sizeof(SendShared));
+  if (!shared) {
+    free(data);
+    return NULL;
+  }
+  atomic_init(&shared->refs, 1);
+  shared->len = len;
+  shared->data = data;
+  return shared;
+}
+
+void SendShared_Release(SendShared *shared) {
+  if (!shared || atomic_fetch_sub(&shared->refs, 1) != 1)
+    return;
+  if (shared->data != (unsigned char *)(shared + 1))
+    free(shared->data);
+  free(shared);
+}
+
+static void FreeFrame(SendFrame *frame) {
+  if (frame->fd >= 0)
+    close(frame->fd);
+  free(frame->owned);
+  if (frame->shared)
+    SendShared_Release(frame->shared);
+  else
+    free(frame->body);
+  free(frame);
+}
+
+static void Link(SendLane *q, SendFrame *frame) {
+  atomic_store_explicit(&frame->next, NULL, memory_order_relaxed);
+  SendFrame *prev =
+      atomic_exchange_explicit(&q->head, frame, memory_order_acq_rel);
+  // Between the exchange and this store the list is briefly cut; the
+  // consumer waits it out in Take
+  atomic_store_explicit(&prev->next, frame, memory_order_release);
+}
+
+// Takes the oldest frame, or NULL if the list is empty or a producer is
+// midway through linking
+static SendFrame *Unlink(SendLane *q) {
+  SendFrame *tail = q->tail;
+  SendFrame *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &q->stub) {
+    if (!next)
+      return NULL;
+    q->tail = tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+    return NULL;
+  // tail is the last frame; park the stub behind it so it can be taken
+  Link(q, &q->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (!next)
+    return NULL;
+  q->tail = next;
+  return tail;
+}
+
+// Takes a frame from a lane known to hold one
+static SendFrame *Take(SendLane *lane) {
+  SendFrame *frame;
+  while (!(frame = Unlink(lane)))
+    sched_yield();
+  atomic_fetch_sub(&lane->depth, 1);
+  return frame;
+}
+
+SendQueue *SendQueue_Create(void) {
+  SendQueue *q = calloc(1, sizeof(SendQueue));
+  if (!q)
+    return NULL;
+  if (sem_init(&q->ready, 0, 0) != 0) {
+    free(q);
+    return NULL;
+  }
+  for (int i = 0; i < SEND_PRIO_COUNT; i++) {
+    SendLane *lane = &q->lanes[i];
+    atomic_store(&lane->stub.next, NULL);
+    atomic_store(&lane->head, &lane->stub);
+    lane->tail = &lane->stub;
+  }
+  return q;
+}
+
+void SendQueue_Destroy(SendQueue *q) {
+  if (!q)
+    return;
+  for (int i = 0; i < SEND_PRIO_COUNT; i++)
+    while (atomic_load(&q->lanes[i].depth) > 0)
+      FreeFrame(Take(&q->lanes[i]));
+  sem_destroy(&q->ready);
+  free(q);
+}
+
+// Copies every part but parts[keptPart], which the frame points at as is
+static SendFrame *NewFrame(int type, const struct iovec *parts, int count,
+                           int keptPart) {
+  size_t copyBytes = 0;
+  for (int i = 0; i < count; i++)
+    if (i != keptPart)
+      copyBytes += parts[i].iov_len;
+  SendFrame *frame = malloc(sizeof(SendFrame) + copyBytes);
+  if (!frame)
+    return NULL;
+
+  frame->type = type;
+  frame->count = count;
+  frame->owned = NULL;
+  frame->fd = -1;
+  frame->body = NULL;
+  frame->bodyLen = 0;
+  frame->shared = NULL;
+  unsigned char *p = frame->copies;
+  for (int i = 0; i < count; i++) {
+    frame->parts[i] = parts[i];
+    if (i == keptPart || parts[i].iov_len == 0)
+      continue;
+    memcpy(p, parts[i].iov_base, parts[i].iov_len);
+    frame->parts[i].iov_base = p;
+    p += parts[i].iov_len;
+  }
+  return frame;
+}
+
+static void Enqueue(SendQueue *q, SendPriority priority, SendFrame *frame) {
+  frame->priority = priority;
+  frame->enqueuedNs = NowNs();
+  SendLane *lane = &q->lanes[priority];
+  Link(lane, frame);
+  atomic_fetch_add(&lane->depth, 1);
+  sem_post(&q->ready);
+}
+
+bool SendQueue_Push(SendQueue *q, SendPriority priority, int type,
+                    const struct iovec *parts, int count, int ownedPart) {
+  SendFrame *frame = NULL;
+  if (count <= SENDQUEUE_MAX_PARTS && !atomic_load(&q->closed))
+    frame = NewFrame(type, parts, count, ownedPart);
+  if (!frame) {
+    if (ownedPart >= 0)
+      free(parts[ownedPart].iov_base);
+    return false;
+  }
+  if (ownedPart >= 0)
+    frame->owned = parts[ownedPart].iov_base;
+  Enqueue(q, priority, frame);
+  return true;
+}
+
+bool SendQueue_PushFile(SendQueue *q, SendPriority priority, int type,
+                        const struct iovec *parts, int count, int fd,
+                        uint64_t fileLen) {
+  SendFrame *frame = NULL;
+  if (count <= SENDQUEUE_MAX_PARTS && !atomic_load(&q->closed))
+    frame = NewFrame(type, parts, count, -1);
+  if (!frame) {
+    close(fd);
+    return false;
+  }
+  frame->fd = fd;
+  frame->bodyLen = fileLen;
+  Enqueue(q, priority, frame);
+  return true;
+}
+
+bool SendQueue_PushBody(SendQueue *q, SendPriority priority, int type,
+                        const struct iovec *parts, int count, void *body,
+                        uint64_t bodyLen) {
+  SendFrame *frame = NULL;
+  if (count <= SENDQUEUE_MAX_PARTS && !atomic_load(&q->closed))
+    frame = NewFrame(type, parts, count, -1);
+  if (!frame) {
+    free(body);
+    return false;
+  }
+  frame->body = body;
+  frame->bodyLen = bodyLen;
+  Enqueue(q, priority, frame);
+  return true;
+}
+
+bool SendQueue_PushShared(SendQueue *q, SendPriority priority, int type,
+                          const struct iovec *parts, int count, int sharedPart,
+                          SendShared *shared) {
+  SendFrame *frame = NULL;
+  if (count <= SENDQUEUE_MAX_PARTS && !atomic_load(&q->closed))
+    frame = NewFrame(type, parts, count, sharedPart);
+  if (!frame)
+    return false;
+  atomic_fetch_add(&shared->refs, 1);
+  frame->shared = shared;
+  if (sharedPart < 0) {
+    frame->body = shared->data;
+    frame->bodyLen = shared->len;
+  }
+  Enqueue(q, priority, frame);
+  return true;
+}
+
+// The semaphore only wakes the writer; lane depths say what is there. A
+// non-waiting Pop leaves its posts behind, which later cost a spare rescan.
+SendFrame *SendQueue_Pop(SendQueue *q, SendPriority maxPriority, bool wait) {
+  for (;;) {
+    if (atomic_load(&q->closed))
+      return NULL;
+    for (int i = 0; i <= (int)maxPriority; i++)
+      if (atomic_load(&q->lanes[i].depth) > 0)
+        return Take(&q->lanes[i]);
+    if (!wait)
+      return NULL;
+    while (sem_wait(&q->ready) != 0 && errno == EINTR)
+      ;
+  }
+}
+
+void SendQueue_Done(SendQueue *q, SendFrame *frame) {
+  uint64_t ns = NowNs() - frame->enqueuedNs;
+  uint64_t avg = atomic_load(&q->avgNs);
+  // EWMA with weight 1/8, seeded by the first frame
+  avg = atomic_load(&q->sent) == 0 ? ns : avg - avg / 8 + ns / 8;
+  atomic_store(&q->avgNs, avg);
+  atomic_store(&q->lastNs, ns);
+  if (ns > atomic_load(&q->maxNs))
+    atomic_store(&q->maxNs, ns);
+  atomic_fetch_add(&q->sent, 1);
+  FreeFrame(frame);
+}
+
+void SendQueue_Drop(SendFrame *frame) { FreeFrame(frame); }
+
+void SendQueue_Close(SendQueue *q) {
+  atomic_store(&q->closed, true);
+  sem_post(&q->ready);
+}
+
+bool SendQueue_Closed(SendQueue *q) { return atomic_load(&q->closed); }
+
+void SendQueue_Stats(SendQueue *q, SendQueueStats *out) {
+  out->depth = 0;
+  for (int i = 0; i < SEND_PRIO_COUNT; i++)
+    out->depth += atomic_load(&q->lanes[i].depth);
+  out->sent = atomic_load(&q->sent);
+  out->lastMs = atomic_load(&q->lastNs) / 1e6;
+  out->avgMs = atomic_load(&q->avgNs) / 1e6;
+  out->maxMs = atomic_load(&q->maxNs) / 1e6;
+}
@@ -0,0 +1,283 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "tls.h"
+
+// Longest a handshake may take before the peer is given up on
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+#define TLS_EPHEMERAL_CERT_DAYS 7
+
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+static char client_ca[256]; // "" for an insecure context
+
+// Last session ticket the client received and the peer it belongs to. TLS 1.3
+// tickets arrive after the handshake, on the first read, so the callback
+// attributes them to the peer of the latest Tls_Connect.
+static SSL_SESSION *client_session = NULL;
+static char client_session_peer[64];
+static char client_connect_peer[64];
+
+static void Tls_LogError(const char *what) {
+  unsigned long err = ERR_get_error();
+  char buf[256];
+  ERR_error_string_n(err, buf, sizeof(buf));
+  LOG_WARN("%s: %s", what, err ? buf : "unknown error");
+  ERR_clear_error();
+}
+
+static bool FileReadable(const char *path) {
+  return path && path[0] && access(path, R_OK) == 0;
+}
+
+static bool Tls_UseEphemeralCert(SSL_CTX *ctx) {
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *cert = X509_new();
+  bool ok = false;
+
+  if (key && cert) {
+    X509_NAME *name = X509_get_subject_name(cert);
+    ok = X509_set_version(cert, 2) &&
+         ASN1_INTEGER_set(X509_get_serialNumber(cert), (long)getpid()) &&
+         X509_gmtime_adj(X509_getm_notBefore(cert), 0) &&
+         X509_gmtime_adj(X509_getm_notAfter(cert),
+                         60L * 60 * 24 * TLS_EPHEMERAL_CERT_DAYS) &&
+         X509_set_pubkey(cert, key) &&
+         X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                    (const unsigned char *)"StegaNet", -1, -1,
+                                    0) &&
+         X509_set_issuer_name(cert, name) &&
+         X509_sign(cert, key, EVP_sha256()) &&
+         SSL_CTX_use_certificate(ctx, cert) == 1 &&
+         SSL_CTX_use_PrivateKey(ctx, key) == 1;
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return ok;
+}
+
+static SSL_CTX *Tls_NewContext(const SSL_METHOD *method) {
+  SSL_CTX *ctx = SSL_CTX_new(method);
+  if (!ctx)
+    return NULL;
+  SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+  // A peer that just closes its socket reads as an orderly shutdown
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+  return ctx;
+}
+
+static SSL_CTX *Tls_ServerContext(const TlsConfig *config) {
+  if (server_ctx)
+    return server_ctx;
+  SSL_CTX *ctx = Tls_NewContext(TLS_server_method());
+  if (!ctx)
+    return NULL;
+
+  bool ok;
+  if (FileReadable(config->certPath) && FileReadable(config->keyPath)) {
+    ok = SSL_CTX_use_certificate_chain_file(ctx, config->certPath) == 1 &&
+         SSL_CTX_use_PrivateKey_file(ctx, config->keyPath, SSL_FILETYPE_PEM) ==
+             1 &&
+         SSL_CTX_check_private_key(ctx) == 1;
+  } else {
+    LOG_INFO("TLS: no certificate at %s, using a self-signed one",
+             config->certPath ? config->certPath : "(none)");
+    ok = Tls_UseEphemeralCert(ctx);
+  }
+  if (!ok) {
+    Tls_LogError("TLS server setup failed");
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+
+  // Stateless tickets; the context (and its ticket keys) lives as long as
+  // the process so any reconnect can resume
+  SSL_CTX_set_num_tickets(ctx, 2);
+  server_ctx = ctx;
+  return ctx;
+}
+
+static int Tls_NewSession(SSL *ssl, SSL_SESSION *session) {
+  pthread_mutex_lock(&tls_lock);
+  SSL_SESSION_free(client_session);
+  client_session = session;
+  memcpy(client_session_peer, client_connect_peer, sizeof(client_session_peer));
+  pthread_mutex_unlock(&tls_lock);
+  return 1; // We keep the reference
+}
+
+static SSL_CTX *Tls_ClientContext(const TlsConfig *config) {
+  const char *ca = "";
+  if (FileReadable(config->caPath)) {
+    ca = config->caPath;
+  } else if (!config->insecure) {
+    LOG_WARN("TLS: no CA at %s to verify the server with; not connecting",
+             config->caPath ? config->caPath : "(none)");
+    return NULL;
+  }
+  if (client_ctx && strcmp(client_ca, ca) == 0)
+    return client_ctx;
+
+  SSL_CTX *ctx = Tls_NewContext(TLS_client_method());
+  if (!ctx)
+    return NULL;
+  if (ca[0]) {
+    if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) {
+      Tls_LogError("TLS: cannot load CA file");
+      SSL_CTX_free(ctx);
+      return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  } else {
+    LOG_WARN("TLS: insecure mode, the server is not authenticated");
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+  }
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, Tls_NewSession);
+
+  SSL_CTX_free(client_ctx);
+  client_ctx = ctx;
+  strncpy(client_ca, ca, sizeof(client_ca) - 1);
+  client_ca[sizeof(client_ca) - 1] = '\0';
+  return ctx;
+}
+
+static long Tls_NowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Drives SSL_accept/SSL_connect to completion on a non-blocking socket,
+// waiting in poll() for whatever it needs next. Gives up after
+// TLS_HANDSHAKE_TIMEOUT_MS or as soon as cancelFd (-1 for none) is readable.
+static bool Tls_Handshake(SSL *ssl, bool server, int cancelFd) {
+  long deadline = Tls_NowMs() + TLS_HANDSHAKE_TIMEOUT_MS;
+  for (;;) {
+    ERR_clear_error();
+    int ret = server ? SSL_accept(ssl) : SSL_connect(ssl);
+    if (ret == 1) {
+      // Read records in bulk rather than one header and body at a time;
+      // kernel TLS batches on its own
+      if (!BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        SSL_set_read_ahead(ssl, 1);
+      return true;
+    }
+    int err = SSL_get_error(ssl, ret);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+      break;
+    long left = deadline - Tls_NowMs();
+    if (left <= 0) {
+      LOG_WARN("TLS handshake timed out");
+      break;
+    }
+    struct pollfd fds[2] = {
+        {SSL_get_fd(ssl), err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, 0},
+        {cancelFd, POLLIN, 0}};
+    if (poll(fds, 2, (int)left) < 0 && errno != EINTR)
+      break;
+    if (fds[1].revents)
+      return false; // Cancelled; nothing worth logging
+  }
+  Tls_LogError(server ? "TLS accept failed" : "TLS connect failed");
+  return false;
+}
+
+static void Tls_LogConnection(SSL *ssl) {
+  LOG_INFO("TLS: %s %s, %s, kernel TLS send %s / recv %s",
+           SSL_get_version(ssl), Tls_CipherName(ssl),
+           Tls_Resumed(ssl) ? "resumed" : "full handshake",
+           Tls_KernelSend(ssl) ? "on" : "off",
+           Tls_KernelRecv(ssl) ? "on" : "off");
+}
+
+SSL *Tls_Accept(int fd, const TlsConfig *config, int cancelFd) {
+  pthread_mutex_lock(&tls_lock);
+  SSL_CTX *ctx = Tls_ServerContext(config);
+  pthread_mutex_unlock(&tls_lock);
+  if (!ctx)
+    return NULL;
+
+  SSL *ssl = SSL_new(ctx);
+  if (!ssl || SSL_set_fd(ssl, fd) != 1 || !Tls_Handshake(ssl, true, cancelFd)) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  Tls_LogConnection(ssl);
+  return ssl;
+}
+
+SSL *Tls_Connect(int fd, const char *host, int port, const TlsConfig *config,
+                 int cancelFd) {
+  char peer[64];
+  snprintf(peer, sizeof(peer), "%s:%d", host, port);
+
+  pthread_mutex_lock(&tls_lock);
+  memcpy(client_connect_peer, peer, sizeof(client_connect_peer));
+  SSL_CTX *ctx = Tls_ClientContext(config);
+  SSL *ssl = ctx ? SSL_new(ctx) : NULL;
+  if (ssl && client_session && strcmp(client_session_peer, peer) == 0 &&
+      SSL_SESSION_is_resumable(client_session))
+    SSL_set_session(ssl, client_session);
+  pthread_mutex_unlock(&tls_lock);
+  if (!ssl)
+    return NULL;
+
+  // A CA vouches for many certificates; only one naming the address we
+  // dialed, as an IP or DNS subjectAltName, stands for this peer
+  unsigned char addr[sizeof(struct in6_addr)];
+  bool isIP = inet_pton(AF_INET, host, addr) == 1 ||
+              inet_pton(AF_INET6, host, addr) == 1;
+  X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+  if (isIP ? X509_VERIFY_PARAM_set1_ip_asc(param, host) != 1
+           : SSL_set1_host(ssl, host) != 1) {
+    Tls_LogError("TLS: cannot set the expected peer name");
+    SSL_free(ssl);
+    return NULL;
+  }
+
+  if (SSL_set_fd(ssl, fd) != 1 || !Tls_Handshake(ssl, false, cancelFd)) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  Tls_LogConnection(ssl);
+  return ssl;
+}
+
+bool Tls_KernelSend(SSL *ssl) {
+  return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+bool Tls_KernelRecv(SSL *ssl) {
+  return ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+bool Tls_Resumed(SSL *ssl) { return ssl && SSL_session_reused(ssl); }
+
+const char *Tls_CipherName(SSL *ssl) {
+  const SSL_CIPHER *cipher = ssl ? SSL_get_current_cipher(ssl) : NULL;
+  return cipher ? SSL_CIPHER_get_name(cipher) : "none";
+}
+
+void Tls_Cleanup(void) {
+  pthread_mutex_lock(&tls_lock);
+  SSL_SESSION_free(client_session);
+  client_session = NULL;
+  SSL_CTX_free(client_ctx);
+  client_ctx = NULL;
+  SSL_CTX_free(server_ctx);
+  server_ctx = NULL;
+  pthread_mutex_unlock(&tls_lock);
+}
@@ -0,0 +1,852 @@
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "transport.h"
+#include "uring.h"
+
+#define TRANSPORT_RECORD_HEADER 4
+#define TRANSPORT_RECORD_BUF                                                   \
+  (TRANSPORT_RECORD_HEADER + TRANSPORT_RECORD_MAX + CRYPTO_GCM_TAG_LEN)
+#define TRANSPORT_BATCH_BUF (TRANSPORT_BATCH_RECORDS * TRANSPORT_RECORD_BUF)
+
+#define TRANSPORT_FILE_CHUNK (64 * 1024)
+
+// How long a sender waits for the peer's hello before giving up on a frame
+#define TRANSPORT_HANDSHAKE_TIMEOUT_SEC 10
+#define TRANSPORT_CIPHER_BIT(c) (1u << (c))
+#define TRANSPORT_CIPHERS                                                      \
+  (TRANSPORT_CIPHER_BIT(CRYPTO_CIPHER_AES256_GCM) |                            \
+   TRANSPORT_CIPHER_BIT(CRYPTO_CIPHER_CHACHA20_POLY1305))
+
+static const char *transport_hkdf_info = "StegaNet transport v2";
+
+static void PutBE32(unsigned char *p, uint32_t v) {
+  p[0] = (v >> 24) & 0xFF;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+static uint32_t GetBE32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+// 96-bit GCM nonce: four zero bytes then the big-endian sequence number
+static void RecordNonce(uint64_t seq, unsigned char *nonce) {
+  memset(nonce, 0, 4);
+  PutBE32(nonce + 4, (uint32_t)(seq >> 32));
+  PutBE32(nonce + 8, (uint32_t)seq);
+}
+
+// Helper to send exactly N bytes
+static bool SocketSendAll(int socket, const unsigned char *buf, size_t len) {
+  size_t total = 0;
+  while (total < len) {
+    ssize_t n = send(socket, buf + total, len - total, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    total += n;
+  }
+  return true;
+}
+
+// Gathers an iovec array into as few sendmsg calls as the socket allows,
+// advancing past whatever a partial write consumed
+static bool SocketSendV(int socket, const struct iovec *iov, int iovcnt) {
+  struct iovec local[TRANSPORT_MAX_IOV];
+  if (iovcnt > TRANSPORT_MAX_IOV)
+    return false;
+  memcpy(local, iov, iovcnt * sizeof(*iov));
+  struct msghdr msg = {0};
+  msg.msg_iov = local;
+  msg.msg_iovlen = iovcnt;
+  while (msg.msg_iovlen > 0) {
+    if (msg.msg_iov->iov_len == 0) {
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+      continue;
+    }
+    ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    while (n > 0) {
+      size_t step = (size_t)n < msg.msg_iov->iov_len ? (size_t)n
+                                                      : msg.msg_iov->iov_len;
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + step;
+      msg.msg_iov->iov_len -= step;
+      n -= step;
+      if (msg.msg_iov->iov_len == 0) {
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+    }
+  }
+  return true;
+}
+
+// Sleeps until the socket has data or Transport_Close signals wakeFd, which
+// stays signalled so later waits return at once too
+static TransportStatus WaitReadable(Transport *t, bool allowTimeout) {
+  for (;;) {
+    struct epoll_event ev[2];
+    int n = epoll_wait(t->pollFd, ev, 2, -1);
+    if (n < 0) {
+      if (errno != EINTR)
+        return TRANSPORT_ERROR;
+      if (allowTimeout)
+        return TRANSPORT_TIMEOUT;
+      continue;
+    }
+    for (int i = 0; i < n; i++)
+      if (ev[i].data.fd == t->wakeFd)
+        return TRANSPORT_CLOSED;
+    if (n > 0)
+      return TRANSPORT_OK;
+  }
+}
+
+// The same through io_uring: whatever has arrived, with no system call
+// unless it has to wait
+static TransportStatus RingRecvSome(Transport *t, unsigned char *buf,
+                                    size_t len, bool allowTimeout,
+                                    size_t *got) {
+  for (;;) {
+    ssize_t n = Uring_Recv(t->ring, buf, len);
+    if (n > 0) {
+      *got = n;
+      return TRANSPORT_OK;
+    }
+    if (n == 0 || errno == ECANCELED)
+      return TRANSPORT_CLOSED;
+    if (errno != EINTR)
+      return TRANSPORT_ERROR;
+    if (allowTimeout)
+      return TRANSPORT_TIMEOUT;
+  }
+}
+
+// One recv(2) of up to len bytes into buf, waiting for data if there is none
+static TransportStatus SocketRecvSome(Transport *t, unsigned char *buf,
+                                      size_t len, bool allowTimeout,
+                                      size_t *got) {
+  if (t->ring)
+    return RingRecvSome(t, buf, len, allowTimeout, got);
+  for (;;) {
+    ssize_t n = recv(t->fd, buf, len, MSG_DONTWAIT);
+    if (n > 0) {
+      *got = n;
+      return TRANSPORT_OK;
+    }
+    if (n == 0)
+      return TRANSPORT_CLOSED;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return TRANSPORT_ERROR;
+    TransportStatus st = WaitReadable(t, allowTimeout);
+    if (st != TRANSPORT_OK)
+      return st;
+  }
+}
+
+// Receives exactly len bytes: what was read ahead first, then the rest
+// straight into buf when it is a record's worth or more, or through the
+// read-ahead when it is less
+static TransportStatus SocketRecvExact(Transport *t, unsigned char *buf,
+                                       size_t len, bool allowTimeout) {
+  size_t total = 0;
+  while (total < len) {
+    size_t ahead = t->inLen - t->inPos;
+    if (ahead > 0) {
+      size_t n = ahead < len - total ? ahead : len - total;
+      memcpy(buf + total, t->in + t->inPos, n);
+      t->inPos += n;
+      total += n;
+      continue;
+    }
+    t->inPos = t->inLen = 0;
+    bool direct = len - total >= TRANSPORT_RECORD_MAX;
+    size_t got;
+    TransportStatus st =
+        direct ? SocketRecvSome(t, buf + total, len - total,
+                                allowTimeout && total == 0, &got)
+               : SocketRecvSome(t, t->in, TRANSPORT_READAHEAD,
+                                allowTimeout && total == 0, &got);
+    if (st != TRANSPORT_OK)
+      return st;
+    if (direct)
+      total += got;
+    else
+      t->inLen = got;
+  }
+  return TRANSPORT_OK;
+}
+
+// Reads ahead until len bytes sit in one piece, moving the unread bytes to
+// the front first if they would not fit
+static TransportStatus SocketRecvView(Transport *t, size_t len,
+                                      bool allowTimeout,
+                                      const unsigned char **data) {
+  if (TRANSPORT_READAHEAD - t->inPos < len) {
+    memmove(t->in, t->in + t->inPos, t->inLen - t->inPos);
+    t->inLen -= t->inPos;
+    t->inPos = 0;
+  }
+  while (t->inLen - t->inPos < len) {
+    size_t got;
+    TransportStatus st =
+        SocketRecvSome(t, t->in + t->inLen, TRANSPORT_READAHEAD - t->inLen,
+                       allowTimeout, &got);
+    if (st != TRANSPORT_OK)
+      return st;
+    t->inLen += got;
+  }
+  *data = t->in + t->inPos;
+  t->inPos += len;
+  return TRANSPORT_OK;
+}
+
+// With TLS one SSL object serves both the sending and the receive thread, so
+// every call on it is made under sslLock. The receive side waits for data
+// with the lock dropped.
+static bool TlsSendAll(Transport *t, const unsigned char *buf, size_t len) {
+  bool ok = true;
+  size_t total = 0;
+  pthread_mutex_lock(&t->sslLock);
+  while (total < len) {
+    size_t n = 0;
+    ERR_clear_error();
+    if (SSL_write_ex(t->ssl, buf + total, len - total, &n) != 1) {
+      int err = SSL_get_error(t->ssl, 0);
+      if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        continue;
+      ok = false;
+      break;
+    }
+    total += n;
+  }
+  pthread_mutex_unlock(&t->sslLock);
+  return ok;
+}
+
+static TransportStatus TlsRecvExact(Transport *t, unsigned char *buf,
+                                    size_t len, bool allowTimeout) {
+  size_t total = 0;
+  while (total < len) {
+    // Counts bytes read ahead but not yet decrypted, unlike SSL_pending
+    pthread_mutex_lock(&t->sslLock);
+    bool pending = SSL_has_pending(t->ssl);
+    pthread_mutex_unlock(&t->sslLock);
+    if (!pending) {
+      TransportStatus st = WaitReadable(t, allowTimeout && total == 0);
+      if (st != TRANSPORT_OK)
+        return st;
+    }
+
+    size_t n = 0;
+    pthread_mutex_lock(&t->sslLock);
+    ERR_clear_error();
+    bool ok = SSL_read_ex(t->ssl, buf + total, len - total, &n) == 1;
+    int err = ok ? SSL_ERROR_NONE : SSL_get_error(t->ssl, 0);
+    int savedErrno = errno;
+    pthread_mutex_unlock(&t->sslLock);
+
+    if (ok) {
+      total += n;
+      continue;
+    }
+    // Post-handshake messages (tickets) and interrupted reads just mean retry
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ||
+        (err == SSL_ERROR_SYSCALL &&
+         (savedErrno == EAGAIN || savedErrno == EWOULDBLOCK ||
+          savedErrno == EINTR)))
+      continue;
+    return err == SSL_ERROR_ZERO_RETURN ? TRANSPORT_CLOSED : TRANSPORT_ERROR;
+  }
+  return TRANSPORT_OK;
+}
+
+static bool SendAll(Transport *t, const unsigned char *buf, size_t len) {
+  return t->ssl ? TlsSendAll(t, buf, len) : SocketSendAll(t->fd, buf, len);
+}
+
+// Writes out the TLS bytes staged by Transport_Send
+static bool TlsFlush(Transport *t) {
+  TransportDirection *d = &t->tx;
+  size_t len = d->plainLen;
+  d->plainLen = 0;
+  return len == 0 || TlsSendAll(t, d->plain, len);
+}
+
+static TransportStatus RecvExact(Transport *t, unsigned char *buf, size_t len,
+                                 bool allowTimeout) {
+  return t->ssl ? TlsRecvExact(t, buf, len, allowTimeout)
+                : SocketRecvExact(t, buf, len, allowTimeout);
+}
+
+static bool Direction_Init(TransportDirection *d) {
+  memset(d, 0, sizeof(*d));
+  d->plain = malloc(TRANSPORT_RECORD_MAX);
+  d->record = malloc(TRANSPORT_RECORD_BUF);
+  return d->plain && d->record;
+}
+
+static void Direction_Free(TransportDirection *d) {
+  OPENSSL_cleanse(d->key, sizeof(d->key));
+  free(d->plain);
+  free(d->record);
+  free(d->batch);
+}
+
+// Key for one direction: both hello nonces, the sender's first, go in as
+// the HKDF salt
+static bool DeriveDirectionKey(const unsigned char *sessionKey,
+                               const unsigned char *senderNonce,
+                               const unsigned char *receiverNonce,
+                               unsigned char *key) {
+  unsigned char nonces[32];
+  memcpy(nonces, senderNonce, 16);
+  memcpy(nonces + 16, receiverNonce, 16);
+  return Crypto_HKDF(sessionKey, CRYPTO_KEY_LEN, nonces, sizeof(nonces),
+                     transport_hkdf_info, key, CRYPTO_KEY_LEN);
+}
+
+Transport *Transport_Create(int fd) {
+  Transport *t = calloc(1, sizeof(Transport));
+  if (!t)
+    return NULL;
+  t->fd = fd;
+  t->txReady = true;
+  t->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  t->pollFd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event sockEv = {.events = EPOLLIN | EPOLLRDHUP, .data.fd = fd};
+  struct epoll_event wakeEv = {.events = EPOLLIN, .data.fd = t->wakeFd};
+  t->in = malloc(TRANSPORT_READAHEAD);
+  if (t->wakeFd < 0 || t->pollFd < 0 ||
+      epoll_ctl(t->pollFd, EPOLL_CTL_ADD, fd, &sockEv) != 0 ||
+      epoll_ctl(t->pollFd, EPOLL_CTL_ADD, t->wakeFd, &wakeEv) != 0 ||
+      !t->in || !Direction_Init(&t->tx) || !Direction_Init(&t->rx)) {
+    Transport_Destroy(t);
+    return NULL;
+  }
+  pthread_mutex_init(&t->txLock, NULL);
+  pthread_mutex_init(&t->sslLock, NULL);
+  pthread_cond_init(&t->txReadyCond, NULL);
+  return t;
+}
+
+void Transport_Destroy(Transport *t) {
+  if (!t)
+    return;
+  Direction_Free(&t->tx);
+  Direction_Free(&t->rx);
+  OPENSSL_cleanse(t->txBase, sizeof(t->txBase));
+  if (t->pollFd >= 0)
+    close(t->pollFd);
+  if (t->wakeFd >= 0)
+    close(t->wakeFd);
+  free(t->in);
+  SSL_free(t->ssl);
+  pthread_mutex_destroy(&t->txLock);
+  pthread_mutex_destroy(&t->sslLock);
+  pthread_cond_destroy(&t->txReadyCond);
+  free(t);
+}
+
+bool Transport_MakeHello(Transport *t, const char *passphrase,
+                         unsigned char *hello) {
+  memset(hello, 0, TRANSPORT_HELLO_LEN);
+  hello[0] = TRANSPORT_HELLO_VERSION;
+  t->localCipher = Crypto_PreferredCipher();
+  hello[39] = (unsigned char)t->localCipher;
+  hello[40] = TRANSPORT_CIPHERS;
+  // The nonce goes out even in cleartext: it is our share of the key the
+  // peer encrypts with
+  if (!Crypto_RandomBytes(t->localNonce, sizeof(t->localNonce)))
+    return false;
+  memcpy(hello + 23, t->localNonce, sizeof(t->localNonce));
+  if (!passphrase)
+    return true;
+
+  // The tx key itself needs the peer's nonce too, so it is derived once the
+  // peer's hello arrives
+  uint32_t iterations;
+  if (!Crypto_SessionKey(passphrase, hello + 7, &iterations, t->txBase))
+    return false;
+
+  hello[1] = TRANSPORT_HELLO_ENCRYPTED;
+  hello[2] = CRYPTO_KDF_PBKDF2_SHA256;
+  PutBE32(hello + 3, iterations);
+  t->txArmed = true;
+  return true;
+}
+
+void Transport_StartTx(Transport *t) {
+  pthread_mutex_lock(&t->txLock);
+  t->txReady = !t->txArmed;
+  pthread_mutex_unlock(&t->txLock);
+}
+
+// Symmetric, so both sides reach the same answer from the two hellos
+static int NegotiateCipher(int local, int peer, unsigned peerMask) {
+  bool peerHasChaCha =
+      peerMask & TRANSPORT_CIPHER_BIT(CRYPTO_CIPHER_CHACHA20_POLY1305);
+  if (peerHasChaCha && (local == CRYPTO_CIPHER_CHACHA20_POLY1305 ||
+                        peer == CRYPTO_CIPHER_CHACHA20_POLY1305))
+    return CRYPTO_CIPHER_CHACHA20_POLY1305;
+  return CRYPTO_CIPHER_AES256_GCM;
+}
+
+bool Transport_AcceptHello(Transport *t, const char *passphrase,
+                           const unsigned char *hello, size_t len) {
+  if (t->helloSeen || len < TRANSPORT_HELLO_MIN_LEN ||
+      hello[0] != TRANSPORT_HELLO_VERSION)
+    return false;
+  // Once we encrypt, a peer that does not could inject cleartext frames
+  bool peerEncrypts = hello[1] & TRANSPORT_HELLO_ENCRYPTED;
+  if (t->txArmed && !peerEncrypts)
+    return false;
+  const unsigned char *peerNonce = hello + 23;
+
+  int peerCipher = CRYPTO_CIPHER_AES256_GCM;
+  unsigned peerMask = TRANSPORT_CIPHER_BIT(CRYPTO_CIPHER_AES256_GCM);
+  if (len >= TRANSPORT_HELLO_LEN) {
+    peerCipher = hello[39];
+    peerMask = hello[40];
+  }
+  int cipher = NegotiateCipher(t->localCipher, peerCipher, peerMask);
+
+  if (peerEncrypts) {
+    // The derivation runs on the receive thread; Crypto_DeriveKey holds the
+    // peer to CRYPTO_KDF_MAX_ITERATIONS, as it does carriers
+    uint32_t iterations = GetBE32(hello + 3);
+    if (!passphrase || hello[2] != CRYPTO_KDF_PBKDF2_SHA256)
+      return false;
+
+    unsigned char sessionKey[CRYPTO_KEY_LEN];
+    bool ok = Crypto_DeriveKey(passphrase, hello + 7, iterations,
+                               sessionKey) &&
+              DeriveDirectionKey(sessionKey, peerNonce, t->localNonce,
+                                 t->rx.key);
+    OPENSSL_cleanse(sessionKey, sizeof(sessionKey));
+    if (!ok)
+      return false;
+
+    t->rx.encrypted = true;
+    t->rx.cipher = cipher;
+    t->rx.seq = 0;
+    t->rx.plainLen = t->rx.plainPos = 0;
+  }
+
+  pthread_mutex_lock(&t->txLock);
+  bool ok = true;
+  if (t->txArmed && !t->tx.encrypted) {
+    ok = DeriveDirectionKey(t->txBase, t->localNonce, peerNonce, t->tx.key);
+    OPENSSL_cleanse(t->txBase, sizeof(t->txBase));
+    t->tx.encrypted = true;
+    t->tx.cipher = cipher;
+    t->tx.seq = 0;
+  }
+  // A failed derivation leaves senders waiting until the link closes
+  t->txReady = ok;
+  t->helloSeen = true;
+  pthread_cond_broadcast(&t->txReadyCond);
+  pthread_mutex_unlock(&t->txLock);
+  return ok;
+}
+
+void Transport_Close(Transport *t) {
+  pthread_mutex_lock(&t->txLock);
+  t->closed = true;
+  pthread_cond_broadcast(&t->txReadyCond);
+  pthread_mutex_unlock(&t->txLock);
+  // wakeFd stays readable from here on, so no receive sleeps again
+  uint64_t one = 1;
+  ssize_t woken = write(t->wakeFd, &one, sizeof(one));
+  (void)woken;
+
+  // Send close_notify; a session freed without it is no longer resumable
+  if (t->ssl) {
+    pthread_mutex_lock(&t->sslLock);
+    if (!(SSL_get_shutdown(t->ssl) & SSL_SENT_SHUTDOWN))
+      SSL_shutdown(t->ssl);
+    ERR_clear_error();
+    pthread_mutex_unlock(&t->sslLock);
+  }
+}
+
+int Transport_Cipher(const Transport *t) {
+  return t && t->tx.encrypted ? t->tx.cipher : 0;
+}
+
+void Transport_AttachTLS(Transport *t, struct ssl_st *ssl) { t->ssl = ssl; }
+
+bool Transport_UseRing(Transport *t, struct Uring *ring) {
+  if (ring && (t->ssl || !Uring_Watch(ring, t->fd, t->wakeFd)))
+    return false;
+  t->ring = ring;
+  return true;
+}
+
+bool Transport_IsEncrypted(const Transport *t) {
+  return t && (t->tx.encrypted || t->ssl);
+}
+
+bool Transport_ZeroCopy(const Transport *t) {
+  if (t->tx.encrypted)
+    return false;
+  return !t->ssl || BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+}
+
+static bool SendRecord(Transport *t, const unsigned char *plain, size_t len) {
+  TransportDirection *d = &t->tx;
+  unsigned char nonce[CRYPTO_GCM_NONCE_LEN];
+  RecordNonce(d->seq++, nonce);
+  PutBE32(d->record, (uint32_t)len);
+  int n = Crypto_AEADSeal(d->cipher, d->key, nonce, d->record,
+                          TRANSPORT_RECORD_HEADER, plain, (int)len,
+                          d->record + TRANSPORT_RECORD_HEADER,
+                          TRANSPORT_RECORD_MAX + CRYPTO_GCM_TAG_LEN);
+  if (n < 0)
+    return false;
+  return SendAll(t, d->record, TRANSPORT_RECORD_HEADER + n);
+}
+
+// Seals count full records in one batch and sends them with a single call.
+// Sequence numbers are assigned in order, so the bytes on the wire are the
+// same as count SendRecord calls.
+static bool SendRecords(Transport *t, const unsigned char *plain, int count) {
+  TransportDirection *d = &t->tx;
+  if (!d->batch && !(d->batch = malloc(TRANSPORT_BATCH_BUF))) {
+    for (int i = 0; i < count; i++) {
+      if (!SendRecord(t, plain + (size_t)i * TRANSPORT_RECORD_MAX,
+                      TRANSPORT_RECORD_MAX))
+        return false;
+    }
+    return true;
+  }
+
+  unsigned char nonces[TRANSPORT_BATCH_RECORDS][CRYPTO_GCM_NONCE_LEN];
+  CryptoAEADJob jobs[TRANSPORT_BATCH_RECORDS];
+  for (int i = 0; i < count; i++) {
+    unsigned char *record = d->batch + (size_t)i * TRANSPORT_RECORD_BUF;
+    RecordNonce(d->seq++, nonces[i]);
+    PutBE32(record, TRANSPORT_RECORD_MAX);
+    jobs[i] = (CryptoAEADJob){nonces[i],
+                              record,
+                              TRANSPORT_RECORD_HEADER,
+                              plain + (size_t)i * TRANSPORT_RECORD_MAX,
+                              TRANSPORT_RECORD_MAX,
+                              record + TRANSPORT_RECORD_HEADER,
+                              TRANSPORT_RECORD_MAX + CRYPTO_GCM_TAG_LEN,
+                              0};
+  }
+  if (!Crypto_AEADSealBatch(d->cipher, d->key, jobs, count))
+    return false;
+  return SendAll(t, d->batch, (size_t)count * TRANSPORT_RECORD_BUF);
+}
+
+bool Transport_BeginSend(Transport *t) {
+  pthread_mutex_lock(&t->txLock);
+  if (!t->txReady && !t->closed) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TRANSPORT_HANDSHAKE_TIMEOUT_SEC;
+    while (!t->txReady && !t->closed &&
+           pthread_cond_timedwait(&t->txReadyCond, &t->txLock, &deadline) == 0)
+      ;
+  }
+  if (!t->txReady || t->closed) {
+    pthread_mutex_unlock(&t->txLock);
+    return false;
+  }
+  return true;
+}
+
+// Under TLS each SSL_write becomes its own TLS record and usually its own
+// segment, so the pieces of a frame are staged in tx.plain and written a full
+// record at a time; whatever is left of a large piece goes straight through
+static bool TlsStage(Transport *t, const unsigned char *p, size_t len) {
+  TransportDirection *d = &t->tx;
+  size_t n = TRANSPORT_RECORD_MAX - d->plainLen;
+  if (n > len)
+    n = len;
+  memcpy(d->plain + d->plainLen, p, n);
+  d->plainLen += n;
+  p += n;
+  len -= n;
+  if (len == 0)
+    return true;
+  if (!TlsFlush(t))
+    return false;
+  if (len >= TRANSPORT_RECORD_MAX)
+    return TlsSendAll(t, p, len);
+  memcpy(d->plain, p, len);
+  d->plainLen = len;
+  return true;
+}
+
+bool Transport_Send(Transport *t, const void *data, size_t len) {
+  const unsigned char *p = data;
+  TransportDirection *d = &t->tx;
+  if (t->ssl)
+    return TlsStage(t, p, len);
+  if (!d->encrypted)
+    return SocketSendAll(t->fd, p, len);
+
+  while (len > 0) {
+    // Full records straight from the caller's buffer, no staging copy
+    if (d->plainLen == 0 && len >= TRANSPORT_RECORD_MAX) {
+      size_t count = len / TRANSPORT_RECORD_MAX;
+      if (count > TRANSPORT_BATCH_RECORDS)
+        count = TRANSPORT_BATCH_RECORDS;
+      bool ok = count > 1 ? SendRecords(t, p, (int)count)
+                          : SendRecord(t, p, TRANSPORT_RECORD_MAX);
+      if (!ok)
+        return false;
+      p += count * TRANSPORT_RECORD_MAX;
+      len -= count * TRANSPORT_RECORD_MAX;
+      continue;
+    }
+    size_t n = TRANSPORT_RECORD_MAX - d->plainLen;
+    if (n > len)
+      n = len;
+    memcpy(d->plain + d->plainLen, p, n);
+    d->plainLen += n;
+    p += n;
+    len -= n;
+    if (d->plainLen == TRANSPORT_RECORD_MAX) {
+      d->plainLen = 0;
+      if (!SendRecord(t, d->plain, TRANSPORT_RECORD_MAX))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool Transport_SendV(Transport *t, const struct iovec *iov, int iovcnt) {
+  if (!t->ssl && !t->tx.encrypted)
+    return SocketSendV(t->fd, iov, iovcnt);
+  // Records and TLS already coalesce the pieces in tx.plain
+  for (int i = 0; i < iovcnt; i++)
+    if (iov[i].iov_len > 0 &&
+        !Transport_Send(t, iov[i].iov_base, iov[i].iov_len))
+      return false;
+  return true;
+}
+
+bool Transport_EndSend(Transport *t) {
+  TransportDirection *d = &t->tx;
+  bool ok = true;
+  if (t->ssl) {
+    ok = TlsFlush(t);
+  } else if (d->encrypted && d->plainLen > 0) {
+    ok = SendRecord(t, d->plain, d->plainLen);
+    d->plainLen = 0;
+  }
+  pthread_mutex_unlock(&t->txLock);
+  return ok;
+}
+
+// Reads count records and opens them in one batch straight into dst, setting
+// *written to the plaintext bytes produced. Only called when the caller wants
+// at least count full records' worth, so the peer must send that many.
+static TransportStatus RecvRecords(Transport *t, unsigned char *dst, int count,
+                                   bool allowTimeout, size_t *written) {
+  TransportDirection *d = &t->rx;
+  if (!d->batch && !(d->batch = malloc(TRANSPORT_BATCH_BUF)))
+    return TRANSPORT_ERROR;
+
+  unsigned char nonces[TRANSPORT_BATCH_RECORDS][CRYPTO_GCM_NONCE_LEN];
+  CryptoAEADJob jobs[TRANSPORT_BATCH_RECORDS];
+  size_t offset = 0;
+  for (int i = 0; i < count; i++) {
+    unsigned char *record = d->batch + (size_t)i * TRANSPORT_RECORD_BUF;
+    TransportStatus st = RecvExact(t, record, TRANSPORT_RECORD_HEADER,
+                                   allowTimeout && i == 0);
+    if (st != TRANSPORT_OK)
+      return st;
+    uint32_t recordLen = GetBE32(record);
+    if (recordLen > TRANSPORT_RECORD_MAX)
+      return TRANSPORT_BAD_RECORD;
+    st = RecvExact(t, record + TRANSPORT_RECORD_HEADER,
+                   recordLen + CRYPTO_GCM_TAG_LEN, false);
+    if (st != TRANSPORT_OK)
+      return st;
+
+    RecordNonce(d->seq++, nonces[i]);
+    jobs[i] = (CryptoAEADJob){nonces[i],
+                              record,
+                              TRANSPORT_RECORD_HEADER,
+                              record + TRANSPORT_RECORD_HEADER,
+                              (int)recordLen + CRYPTO_GCM_TAG_LEN,
+                              dst + offset,
+                              (int)recordLen,
+                              0};
+    offset += recordLen;
+  }
+  if (!Crypto_AEADOpenBatch(d->cipher, d->key, jobs, count))
+    return TRANSPORT_BAD_RECORD;
+  *written = offset;
+  return TRANSPORT_OK;
+}
+
+static bool FileEndsBy(int fd, off_t offset) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && st.st_size <= offset;
+}
+
+bool Transport_SendFile(Transport *t, int fileFd, off_t offset, size_t len,
+                        size_t *sent) {
+  size_t want = len;
+  *sent = 0;
+  if (Transport_ZeroCopy(t)) {
+    // The frame header staged ahead of the file data goes first
+    if (t->ssl && !TlsFlush(t))
+      return false;
+    while (len > 0) {
+      ssize_t n;
+      if (t->ssl) {
+        pthread_mutex_lock(&t->sslLock);
+        n = SSL_sendfile(t->ssl, fileFd, offset, len, 0);
+        pthread_mutex_unlock(&t->sslLock);
+        offset += n > 0 ? n : 0;
+      } else {
+        n = sendfile(t->fd, fileFd, &offset, len); // Advances offset
+        if (n < 0 && errno == EINTR)
+          continue;
+      }
+      if (n <= 0) {
+        if (!FileEndsBy(fileFd, offset))
+          return false;
+        ERR_clear_error();
+        break;
+      }
+      len -= n;
+    }
+    *sent = want - len;
+    return true;
+  }
+
+  // Records or user-space TLS: the bytes have to pass through us anyway
+  unsigned char *chunk = malloc(TRANSPORT_FILE_CHUNK);
+  if (!chunk)
+    return false;
+  bool ok = true;
+  while (ok && len > 0) {
+    size_t piece = len < TRANSPORT_FILE_CHUNK ? len : TRANSPORT_FILE_CHUNK;
+    ssize_t n = pread(fileFd, chunk, piece, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0)
+      break; // The file ends here
+    ok = n > 0 && Transport_Send(t, chunk, n);
+    offset += n;
+    len -= n > 0 ? (size_t)n : 0;
+  }
+  free(chunk);
+  *sent = want - len;
+  return ok;
+}
+
+TransportStatus Transport_Recv(Transport *t, void *buf, size_t len,
+                               bool allowTimeout) {
+  unsigned char *dst = buf;
+  TransportDirection *d = &t->rx;
+  if (!d->encrypted)
+    return RecvExact(t, dst, len, allowTimeout);
+
+  while (len > 0) {
+    if (d->plainPos < d->plainLen) {
+      size_t n = d->plainLen - d->plainPos;
+      if (n > len)
+        n = len;
+      memcpy(dst, d->plain + d->plainPos, n);
+      d->plainPos += n;
+      dst += n;
+      len -= n;
+      allowTimeout = false;
+      continue;
+    }
+
+    if (len >= 2 * TRANSPORT_RECORD_MAX) {
+      size_t count = len / TRANSPORT_RECORD_MAX;
+      if (count > TRANSPORT_BATCH_RECORDS)
+        count = TRANSPORT_BATCH_RECORDS;
+      size_t written = 0;
+      TransportStatus st =
+          RecvRecords(t, dst, (int)count, allowTimeout, &written);
+      if (st != TRANSPORT_OK)
+        return st;
+      dst += written;
+      len -= written;
+      allowTimeout = false;
+      continue;
+    }
+
+    TransportStatus st =
+        RecvExact(t, d->record, TRANSPORT_RECORD_HEADER, allowTimeout);
+    if (st != TRANSPORT_OK)
+      return st;
+    allowTimeout = false;
+
+    uint32_t recordLen = GetBE32(d->record);
+    if (recordLen > TRANSPORT_RECORD_MAX)
+      return TRANSPORT_BAD_RECORD;
+    unsigned char *sealed = d->record + TRANSPORT_RECORD_HEADER;
+    st = RecvExact(t, sealed, recordLen + CRYPTO_GCM_TAG_LEN, false);
+    if (st != TRANSPORT_OK)
+      return st;
+
+    // Whole records the caller wants are opened straight into its buffer
+    unsigned char nonce[CRYPTO_GCM_NONCE_LEN];
+    RecordNonce(d->seq++, nonce);
+    unsigned char *target = len >= recordLen ? dst : d->plain;
+    int n = Crypto_AEADOpen(d->cipher, d->key, nonce, d->record,
+                            TRANSPORT_RECORD_HEADER, sealed,
+                            (int)recordLen + CRYPTO_GCM_TAG_LEN, target,
+                            TRANSPORT_RECORD_MAX);
+    if (n < 0)
+      return TRANSPORT_BAD_RECORD;
+    if (target == dst) {
+      dst += n;
+      len -= n;
+    } else {
+      d->plainLen = n;
+      d->plainPos = 0;
+    }
+  }
+  return TRANSPORT_OK;
+}
+
+TransportStatus Transport_RecvView(Transport *t, void *scratch, size_t len,
+                                   bool allowTimeout,
+                                   const unsigned char **data) {
+  TransportDirection *d = &t->rx;
+  if (!t->ssl && !d->encrypted && len <= TRANSPORT_READAHEAD)
+    return SocketRecvView(t, len, allowTimeout, data);
+  if (d->encrypted && d->plainLen - d->plainPos >= len) {
+    *data = d->plain + d->plainPos;
+    d->plainPos += len;
+    return TRANSPORT_OK;
+  }
+  *data = scratch;
+  return Transport_Recv(t, scratch, len, allowTimeout);
+}
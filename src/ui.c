@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include "network.h"
+#include "outbox.h"
 #include "steganography.h"
 #include "ui.h"
 #include "utils.h"
@@ -196,6 +197,20 @@ void DrawConnectionDialog(AppState *state) {
   DrawCircle(dialogRect.x + 185, dialogRect.y + 270, 6,
              validPort ? MODERN_SUCCESS : MODERN_ERROR);
 
+  // TLS must match on both ends
+  DrawText("TLS", dialogRect.x + 220, dialogRect.y + 230, 12,
+           MODERN_TEXT_LIGHT);
+  Rectangle tlsToggle = {dialogRect.x + 220, dialogRect.y + 255, 30, 30};
+  DrawRectangleRounded(tlsToggle, 0.2f, 8,
+                       state->useTLS ? MODERN_SUCCESS : MODERN_SURFACE_2);
+  DrawRectangleRoundedLines(tlsToggle, 0.2f, 8, MODERN_BORDER);
+  if (state->useTLS)
+    DrawText("ON", tlsToggle.x + 8, tlsToggle.y + 10, 10, WHITE);
+  if (CheckCollisionPointRec(GetMousePosition(), tlsToggle) &&
+      IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
+    state->useTLS = !state->useTLS;
+  }
+
   pulseTime += GetFrameTime();
   float pulse = (sinf(pulseTime * 3.0f) + 1.0f) / 2.0f;
   Rectangle connectRect = {dialogRect.x + 180, dialogRect.y + 310, 120, 45};
@@ -208,18 +223,52 @@ void DrawConnectionDialog(AppState *state) {
                             (unsigned char)(50 * pulse)});
   }
 
-  if (DrawEnhancedButton(connectRect, "Connect", connectColor,
-                         (Color){connectColor.r - 20, connectColor.g - 20,
-                                 connectColor.b - 20, 255},
-                         0)) {
+  // The attempt runs on its own thread; until it ends the button cancels it
+  ConnectPhase phase = state->connection.connectPhase;
+  if (phase != CONNECT_IDLE) {
+    if (DrawEnhancedButton(connectRect, "Cancel", MODERN_ERROR, MODERN_DARK,
+                           0)) {
+      CloseConnection(state);
+    }
+  } else if (DrawEnhancedButton(connectRect, "Connect", connectColor,
+                                (Color){connectColor.r - 20,
+                                        connectColor.g - 20,
+                                        connectColor.b - 20, 255},
+                                0)) {
     if (validPort) {
-      InitializeConnection(state, state->isServer, state->serverIPBuffer, port);
+      StartConnection(state, state->isServer, state->serverIPBuffer, port);
     } else {
       ShowStatus(state, "Invalid port number");
     }
   }
 
-  if (strlen(state->statusMessage) > 0 && state->statusTimer > 0) {
+  if (phase != CONNECT_IDLE) {
+    char progress[128];
+    int waited = (int)(GetTime() - state->connection.connectStarted);
+    if (phase == CONNECT_LISTENING)
+      snprintf(progress, sizeof(progress),
+               "Waiting for a peer on port %d... %d s", port, waited);
+    else if (phase == CONNECT_DIALING)
+      snprintf(progress, sizeof(progress), "Connecting to %s:%d... %d s",
+               state->serverIPBuffer, port, waited);
+    else if (phase == CONNECT_BACKOFF)
+      snprintf(progress, sizeof(progress),
+               "Link lost; redialing %s:%d in %.0f s (attempt %d)",
+               state->serverIPBuffer, port,
+               fmax(state->connection.redialAt - GetTime(), 0),
+               state->connection.redialAttempt);
+    else
+      snprintf(progress, sizeof(progress), "TLS handshake... %d s", waited);
+    Rectangle progressRect = {dialogRect.x + 20,
+                              dialogRect.y + dialogRect.height - 40,
+                              dialogRect.width - 40, 25};
+    DrawRectangleRounded(
+        progressRect, 0.06f, 8,
+        (Color){MODERN_ACCENT.r, MODERN_ACCENT.g, MODERN_ACCENT.b, 20});
+    DrawRectangleRoundedLines(progressRect, 0.068, 1, MODERN_ACCENT);
+    DrawText(progress, progressRect.x + 10, progressRect.y + 6, 12,
+             MODERN_ACCENT);
+  } else if (strlen(state->statusMessage) > 0 && state->statusTimer > 0) {
     Rectangle statusRect = {dialogRect.x + 20,
                             dialogRect.y + dialogRect.height - 40,
                             dialogRect.width - 40, 25};
@@ -612,8 +661,13 @@ void DrawChat(AppState *state) {
   DrawText(" ", 42, 32, 16, MODERN_ACCENT);
   const char *contactName =
       state->connection.isConnected ? "Secure Contact" : "Disconnected";
-  const char *contactStatus =
-      state->connection.isConnected ? "Online & Encrypted" : "Offline";
+  // A client that lost its link redials on its own until cancelled
+  bool redialing = state->connection.redial &&
+                   state->connection.connectPhase != CONNECT_IDLE;
+  const char *contactStatus = state->connection.isConnected
+                                  ? "Online & Encrypted"
+                              : redialing ? "Reconnecting..."
+                                          : "Offline";
 
   DrawText(contactName, 85, 25, 18, WHITE);
   DrawText(contactStatus, 85, 48, 12, (Color){255, 255, 255, 200});
@@ -635,22 +689,49 @@ void DrawChat(AppState *state) {
   }
 
   if (state->connection.isConnected) {
-    char connInfo[100];
-    sprintf(connInfo, "%s:%d", state->connection.remoteIP,
-            state->connection.remotePort);
+    // One peer by address, several by count; the ping is the slowest one's
+    int peers = 0;
+    char connInfo[100] = "";
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      const Peer *peer = &state->connection.peers[i];
+      if (!peer->isConnected)
+        continue;
+      if (peers++ == 0)
+        sprintf(connInfo, "%s:%d", peer->remoteIP, peer->remotePort);
+    }
+    if (peers > 1)
+      sprintf(connInfo, "%d peers", peers);
     int textWidth = MeasureText(connInfo, 12);
     Rectangle connBadge = {screenWidth - textWidth - 25, 20, textWidth + 10,
                            25};
     DrawRectangleRounded(connBadge, 0.5f, 12, (Color){255, 255, 255, 30});
     DrawText(connInfo, connBadge.x + 5, connBadge.y + 7, 11, WHITE);
 
-    char latencyStr[40];
-    sprintf(latencyStr, "Ping: %.0f ms", state->connection.latency);
+    char latencyStr[120];
+    RttStats rtt;
+    int latLen =
+        GetRttStats(state, &rtt)
+            ? snprintf(latencyStr, sizeof(latencyStr),
+                       "Ping: %.1f ms  p99 %.1f  max %.1f", rtt.p50Ms,
+                       rtt.p99Ms, rtt.maxMs)
+            : snprintf(latencyStr, sizeof(latencyStr), "Ping: -- ms");
+    SendQueueStats sendStats;
+    if (GetSendQueueStats(state, &sendStats) && sendStats.depth > 0)
+      snprintf(latencyStr + latLen, sizeof(latencyStr) - latLen,
+               "  Queued: %zu (%.0f ms)", sendStats.depth, sendStats.avgMs);
     int latWidth = MeasureText(latencyStr, 11);
     DrawText(latencyStr, connBadge.x - latWidth - 15, connBadge.y + 7, 11,
              (Color){150, 255, 150, 200});
   }
-  if (state->connection.isConnected) {
+  int queuedLines = state->outbox ? Outbox_Pending(state->outbox) : 0;
+  if (!state->connection.isConnected && queuedLines > 0) {
+    char queuedStr[64];
+    snprintf(queuedStr, sizeof(queuedStr), "%d message%s waiting to send",
+             queuedLines, queuedLines == 1 ? "" : "s");
+    DrawText(queuedStr, screenWidth - MeasureText(queuedStr, 11) - 20, 27, 11,
+             (Color){255, 220, 150, 220});
+  }
+  if (state->connection.isConnected || redialing) {
     Rectangle disconnectRect = {screenWidth - 120, 50, 100, 25};
     if (DrawEnhancedButton(disconnectRect, "Disconnect", MODERN_ERROR,
                            MODERN_DARK, 7)) {
@@ -993,6 +1074,20 @@ void DrawChat(AppState *state) {
                    state->encryptionKeyEditMode)) {
       state->encryptionKeyEditMode = !state->encryptionKeyEditMode;
     }
+
+    // Encrypt the whole connection too; applies from the next connect
+    DrawText("Wire:", startX + 395, buttonY + 8, 12, MODERN_TEXT);
+    Rectangle wireToggle = {startX + 435, buttonY, 30, 30};
+    DrawRectangleRounded(wireToggle, 0.2f, 8,
+                         state->encryptTransport ? MODERN_SUCCESS
+                                                 : MODERN_SURFACE_2);
+    DrawRectangleRoundedLines(wireToggle, 0.2f, 8, MODERN_BORDER);
+    if (state->encryptTransport)
+      DrawText("ON", wireToggle.x + 8, wireToggle.y + 10, 10, WHITE);
+    if (CheckCollisionPointRec(GetMousePosition(), wireToggle) &&
+        IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
+      state->encryptTransport = !state->encryptTransport;
+    }
   }
 
   buttonY += 45;
@@ -1086,11 +1181,13 @@ void DrawChat(AppState *state) {
     canSend = true;
   }
 
+  // Text written offline waits in the outbox for the next link
+  bool canDeliver =
+      state->connection.isConnected ||
+      (state->outbox && state->selectedMessageType == MSG_TEXT);
   Rectangle sendRect = {screenWidth - 90, buttonY, 70, 35};
-  Color sendColor = canSend && state->connection.isConnected
-                        ? MODERN_SUCCESS
-                        : MODERN_TEXT_LIGHT;
-  if (canSend && state->connection.isConnected) {
+  Color sendColor = canSend && canDeliver ? MODERN_SUCCESS : MODERN_TEXT_LIGHT;
+  if (canSend && canDeliver) {
     float sendPulse = (sinf(pulseTime * 3.0f) + 1.0f) / 2.0f;
     DrawRing((Vector2){sendRect.x + sendRect.width / 2,
                        sendRect.y + sendRect.height / 2},
@@ -1100,7 +1197,7 @@ void DrawChat(AppState *state) {
   }
 
   if (DrawEnhancedButton(sendRect, "Send", sendColor, MODERN_DARK, 21)) {
-    if (canSend && state->connection.isConnected) {
+    if (canSend && canDeliver) {
       if (state->selectedMessageType == MSG_TEXT) {
         SendMessage(state, state->inputBuffer, MSG_TEXT);
         state->inputBuffer[0] = '\0';
@@ -1109,7 +1206,7 @@ void DrawChat(AppState *state) {
         state->selectedFilePath[0] = '\0';
         state->hiddenMessageBuffer[0] = '\0';
       }
-    } else if (!state->connection.isConnected) {
+    } else if (!canDeliver) {
       ShowStatus(state, "Not connected!");
     }
   }
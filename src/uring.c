@@ -0,0 +1,491 @@
+// syscall(2) is not part of POSIX
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define URING_BUF_GROUP 0
+
+// user_data of each kind of request; writes add their buffer index
+#define URING_TAG_RECV 1
+#define URING_TAG_WAKE 2
+#define URING_TAG_CANCEL 3
+#define URING_TAG_WRITE 16
+
+typedef struct {
+  uint16_t bid;
+  uint32_t len;
+  uint32_t pos;
+} UringChunk;
+
+struct Uring {
+  int fd;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  _Atomic unsigned *sqHead, *sqTail;
+  unsigned *sqArray;
+  unsigned sqMask, sqEntries;
+  unsigned sqLocalTail;
+  unsigned unsubmitted;
+  _Atomic unsigned *cqHead, *cqTail;
+  struct io_uring_cqe *cqes;
+  unsigned cqMask;
+
+  // Receive side. Received buffers wait in ready, oldest first, and go back
+  // to the kernel's ring once read out.
+  int sockFd;
+  struct io_uring_buf_ring *bufRing;
+  unsigned char *recvBufs;
+  uint16_t bufTail;
+  UringChunk ready[URING_RECV_BUFS];
+  int readyHead, readyCount;
+  bool recvArmed, wakeArmed;
+  bool recvEnded; // Peer shut down (recvError 0) or the socket failed
+  int recvError;
+  bool woken;
+
+  // Write side: writeBufs[fill] is being filled for fillFd at fillOffset
+  unsigned char *writeBufs;
+  bool writeBusy[URING_WRITE_BUFS];
+  uint32_t writeLen[URING_WRITE_BUFS];
+  int writesInFlight;
+  int fill;
+  int fillFd;
+  uint64_t fillOffset;
+  size_t fillLen;
+  bool writeFailed;
+};
+
+static int Setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int Register(Uring *r, unsigned op, const void *arg, unsigned count) {
+  return (int)syscall(__NR_io_uring_register, r->fd, op, arg, count);
+}
+
+// Submits what is queued and, with wait, sleeps until a completion arrives
+static int Enter(Uring *r, bool wait) {
+  int n = (int)syscall(__NR_io_uring_enter, r->fd, r->unsubmitted,
+                       wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL,
+                       0);
+  if (n > 0)
+    r->unsubmitted -= (unsigned)n < r->unsubmitted ? (unsigned)n
+                                                   : r->unsubmitted;
+  return n;
+}
+
+static struct io_uring_sqe *NextSqe(Uring *r) {
+  unsigned head = atomic_load_explicit(r->sqHead, memory_order_acquire);
+  if (r->sqLocalTail - head >= r->sqEntries) {
+    Enter(r, false);
+    head = atomic_load_explicit(r->sqHead, memory_order_acquire);
+    if (r->sqLocalTail - head >= r->sqEntries)
+      return NULL;
+  }
+  unsigned index = r->sqLocalTail & r->sqMask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sqArray[index] = index;
+  return sqe;
+}
+
+static void Queue(Uring *r) {
+  r->sqLocalTail++;
+  r->unsubmitted++;
+  atomic_store_explicit(r->sqTail, r->sqLocalTail, memory_order_release);
+}
+
+static void GiveBack(Uring *r, uint16_t bid) {
+  struct io_uring_buf *buf =
+      &r->bufRing->bufs[r->bufTail & (URING_RECV_BUFS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(r->recvBufs + bid * URING_RECV_BUF_SIZE);
+  buf->len = URING_RECV_BUF_SIZE;
+  buf->bid = bid;
+  r->bufTail++;
+  atomic_store_explicit((_Atomic uint16_t *)&r->bufRing->tail, r->bufTail,
+                        memory_order_release);
+}
+
+static bool ArmRecv(Uring *r) {
+  struct io_uring_sqe *sqe = NextSqe(r);
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = r->sockFd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = URING_TAG_RECV;
+  Queue(r);
+  r->recvArmed = true;
+  return true;
+}
+
+static void OnRecv(Uring *r, const struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    r->recvArmed = false; // Rearmed once what it left has been read
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res <= 0) {
+      GiveBack(r, bid);
+    } else {
+      int slot = (r->readyHead + r->readyCount) % URING_RECV_BUFS;
+      r->ready[slot] = (UringChunk){bid, (uint32_t)cqe->res, 0};
+      r->readyCount++;
+      return;
+    }
+  }
+  // Out of buffers only pauses the receive; anything else ends it
+  if (cqe->res == 0) {
+    r->recvEnded = true;
+    r->recvError = 0;
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+    r->recvEnded = true;
+    r->recvError = -cqe->res;
+  }
+}
+
+static void OnWrite(Uring *r, int index, int res) {
+  r->writeBusy[index] = false;
+  r->writesInFlight--;
+  if (res < 0 || (uint32_t)res != r->writeLen[index])
+    r->writeFailed = true;
+}
+
+// Handles every completion posted so far; returns how many
+static int Reap(Uring *r) {
+  unsigned head = atomic_load_explicit(r->cqHead, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(r->cqTail, memory_order_acquire);
+  int count = 0;
+  for (; head != tail; head++, count++) {
+    const struct io_uring_cqe *cqe = &r->cqes[head & r->cqMask];
+    if (cqe->user_data == URING_TAG_RECV) {
+      OnRecv(r, cqe);
+    } else if (cqe->user_data == URING_TAG_WAKE) {
+      r->wakeArmed = false;
+      if (cqe->res >= 0)
+        r->woken = true;
+    } else if (cqe->user_data >= URING_TAG_WRITE) {
+      OnWrite(r, (int)(cqe->user_data - URING_TAG_WRITE), cqe->res);
+    }
+  }
+  atomic_store_explicit(r->cqHead, head, memory_order_release);
+  return count;
+}
+
+static void Unmap(Uring *r) {
+  if (r->sqRing)
+    munmap(r->sqRing, r->sqRingSize);
+  if (r->cqRing && r->cqRing != r->sqRing)
+    munmap(r->cqRing, r->cqRingSize);
+  if (r->sqes)
+    munmap(r->sqes, r->sqesSize);
+  if (r->bufRing)
+    munmap(r->bufRing, URING_RECV_BUFS * sizeof(struct io_uring_buf));
+}
+
+// mmap that returns NULL on failure, so Unmap can tell what is mapped
+static void *Map(size_t len, int flags, int fd, off_t offset) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static bool MapRings(Uring *r, const struct io_uring_params *p) {
+  r->sqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  r->cqRingSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p->features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cqRingSize > r->sqRingSize)
+    r->sqRingSize = r->cqRingSize;
+  r->sqRing = Map(r->sqRingSize, MAP_SHARED | MAP_POPULATE, r->fd,
+                  IORING_OFF_SQ_RING);
+  if (!r->sqRing)
+    return false;
+  r->cqRing = single ? r->sqRing
+                     : Map(r->cqRingSize, MAP_SHARED | MAP_POPULATE, r->fd,
+                           IORING_OFF_CQ_RING);
+  r->sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = Map(r->sqesSize, MAP_SHARED | MAP_POPULATE, r->fd,
+                IORING_OFF_SQES);
+  if (!r->cqRing || !r->sqes)
+    return false;
+
+  unsigned char *sq = r->sqRing, *cq = r->cqRing;
+  r->sqHead = (_Atomic unsigned *)(sq + p->sq_off.head);
+  r->sqTail = (_Atomic unsigned *)(sq + p->sq_off.tail);
+  r->sqMask = *(unsigned *)(sq + p->sq_off.ring_mask);
+  r->sqEntries = p->sq_entries;
+  r->sqArray = (unsigned *)(sq + p->sq_off.array);
+  r->sqLocalTail = atomic_load(r->sqTail);
+  r->cqHead = (_Atomic unsigned *)(cq + p->cq_off.head);
+  r->cqTail = (_Atomic unsigned *)(cq + p->cq_off.tail);
+  r->cqMask = *(unsigned *)(cq + p->cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+  return true;
+}
+
+// Registers the receive buffer ring and the write buffers
+static bool RegisterBuffers(Uring *r) {
+  r->recvBufs = malloc((size_t)URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+  r->writeBufs = malloc((size_t)URING_WRITE_BUFS * URING_WRITE_BUF_SIZE);
+  r->bufRing = Map(URING_RECV_BUFS * sizeof(struct io_uring_buf),
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (!r->recvBufs || !r->writeBufs || !r->bufRing)
+    return false;
+
+  struct io_uring_buf_reg reg = {0};
+  reg.ring_addr = (uint64_t)(uintptr_t)r->bufRing;
+  reg.ring_entries = URING_RECV_BUFS;
+  reg.bgid = URING_BUF_GROUP;
+  if (Register(r, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    return false;
+  for (uint16_t bid = 0; bid < URING_RECV_BUFS; bid++)
+    GiveBack(r, bid);
+
+  struct iovec iov[URING_WRITE_BUFS];
+  for (int i = 0; i < URING_WRITE_BUFS; i++) {
+    iov[i].iov_base = r->writeBufs + (size_t)i * URING_WRITE_BUF_SIZE;
+    iov[i].iov_len = URING_WRITE_BUF_SIZE;
+  }
+  return Register(r, IORING_REGISTER_BUFFERS, iov, URING_WRITE_BUFS) == 0;
+}
+
+static Uring *NewRing(void) {
+  Uring *r = calloc(1, sizeof(Uring));
+  if (!r)
+    return NULL;
+  r->sockFd = -1;
+  r->fill = -1;
+  struct io_uring_params p = {0};
+  r->fd = Setup(URING_ENTRIES, &p);
+  if (r->fd < 0 || !MapRings(r, &p) || !RegisterBuffers(r)) {
+    Uring_Destroy(r);
+    return NULL;
+  }
+  return r;
+}
+
+// Multishot receive came in Linux 6.0 without a feature flag of its own, so
+// it is tried once on a socket pair: an older kernel rejects it or ends it
+// after the first completion
+static bool uringSupported = false;
+static pthread_once_t uringProbe = PTHREAD_ONCE_INIT;
+
+static void Probe(void) {
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    return;
+  Uring *r = NewRing();
+  char byte = 1;
+  if (r && Uring_Watch(r, pair[0], -1) &&
+      write(pair[1], &byte, 1) == 1 && Uring_Recv(r, &byte, 1) == 1 &&
+      r->recvArmed)
+    uringSupported = true;
+  close(pair[1]);
+  Uring_Destroy(r);
+  close(pair[0]);
+}
+
+Uring *Uring_Create(void) {
+  pthread_once(&uringProbe, Probe);
+  return uringSupported ? NewRing() : NULL;
+}
+
+void Uring_Destroy(Uring *r) {
+  if (!r)
+    return;
+  if (r->fd >= 0 && r->sqes && r->cqRing) {
+    // The kernel must be done with the buffers before they are freed
+    struct io_uring_sqe *sqe =
+        r->recvArmed || r->wakeArmed ? NextSqe(r) : NULL;
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+      sqe->user_data = URING_TAG_CANCEL;
+      Queue(r);
+    }
+    while (r->recvArmed || r->wakeArmed || r->writesInFlight > 0) {
+      if (Reap(r) > 0)
+        continue;
+      if (Enter(r, true) < 0 && errno != EINTR)
+        break;
+    }
+  }
+  if (r->fd >= 0)
+    close(r->fd);
+  Unmap(r);
+  free(r->recvBufs);
+  free(r->writeBufs);
+  free(r);
+}
+
+bool Uring_Watch(Uring *r, int fd, int wakeFd) {
+  r->sockFd = fd;
+  if (wakeFd < 0)
+    return true;
+  struct io_uring_sqe *sqe = NextSqe(r);
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = wakeFd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_TAG_WAKE;
+  Queue(r);
+  r->wakeArmed = true;
+  return true;
+}
+
+// Copies out of the received buffers, oldest first, handing each back once
+// it is empty
+static size_t TakeReady(Uring *r, unsigned char *buf, size_t len) {
+  size_t total = 0;
+  while (total < len && r->readyCount > 0) {
+    UringChunk *c = &r->ready[r->readyHead];
+    size_t n = c->len - c->pos;
+    if (n > len - total)
+      n = len - total;
+    memcpy(buf + total,
+           r->recvBufs + (size_t)c->bid * URING_RECV_BUF_SIZE + c->pos, n);
+    c->pos += n;
+    total += n;
+    if (c->pos == c->len) {
+      GiveBack(r, c->bid);
+      r->readyHead = (r->readyHead + 1) % URING_RECV_BUFS;
+      r->readyCount--;
+    }
+  }
+  return total;
+}
+
+ssize_t Uring_Recv(Uring *r, void *buf, size_t len) {
+  for (;;) {
+    size_t n = TakeReady(r, buf, len);
+    if (n > 0)
+      return (ssize_t)n;
+    if (r->recvEnded) {
+      if (r->recvError == 0)
+        return 0;
+      errno = r->recvError;
+      return -1;
+    }
+    if (r->woken) {
+      errno = ECANCELED;
+      return -1;
+    }
+    if (!r->recvArmed && !ArmRecv(r)) {
+      errno = EBUSY;
+      return -1;
+    }
+    if (Reap(r) > 0)
+      continue;
+    if (Enter(r, true) < 0 && errno != EAGAIN && errno != EBUSY)
+      return -1;
+  }
+}
+
+// Queues the write of the buffer being filled
+static void SubmitFill(Uring *r) {
+  if (r->fill < 0)
+    return;
+  struct io_uring_sqe *sqe = NextSqe(r);
+  if (!sqe) {
+    r->writeFailed = true;
+    r->fill = -1;
+    return;
+  }
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = r->fillFd;
+  sqe->addr =
+      (uint64_t)(uintptr_t)(r->writeBufs + (size_t)r->fill *
+                                               URING_WRITE_BUF_SIZE);
+  sqe->len = (uint32_t)r->fillLen;
+  sqe->off = r->fillOffset;
+  sqe->buf_index = (uint16_t)r->fill;
+  sqe->user_data = URING_TAG_WRITE + (uint64_t)r->fill;
+  Queue(r);
+  r->writeBusy[r->fill] = true;
+  r->writeLen[r->fill] = (uint32_t)r->fillLen;
+  r->writesInFlight++;
+  r->fill = -1;
+  // Started now if the disk is idle; otherwise it goes with the next enter
+  if (r->writesInFlight == 1)
+    Enter(r, false);
+}
+
+// A write buffer no request is using, waiting for one if need be
+static int FreeWriteBuffer(Uring *r) {
+  for (;;) {
+    for (int i = 0; i < URING_WRITE_BUFS; i++)
+      if (!r->writeBusy[i])
+        return i;
+    if (Reap(r) > 0)
+      continue;
+    if (Enter(r, true) < 0 && errno != EINTR)
+      return -1;
+  }
+}
+
+bool Uring_Write(Uring *r, int fd, uint64_t offset, const void *data,
+                 size_t len) {
+  const unsigned char *p = data;
+  while (len > 0 && !r->writeFailed) {
+    if (r->fill >= 0 &&
+        (fd != r->fillFd || offset != r->fillOffset + r->fillLen))
+      SubmitFill(r);
+    if (r->fill < 0) {
+      int index = FreeWriteBuffer(r);
+      if (index < 0) {
+        r->writeFailed = true;
+        break;
+      }
+      r->fill = index;
+      r->fillFd = fd;
+      r->fillOffset = offset;
+      r->fillLen = 0;
+    }
+    size_t n = URING_WRITE_BUF_SIZE - r->fillLen;
+    if (n > len)
+      n = len;
+    memcpy(r->writeBufs + (size_t)r->fill * URING_WRITE_BUF_SIZE +
+               r->fillLen,
+           p, n);
+    r->fillLen += n;
+    offset += n;
+    p += n;
+    len -= n;
+    if (r->fillLen == URING_WRITE_BUF_SIZE)
+      SubmitFill(r);
+  }
+  return !r->writeFailed;
+}
+
+bool Uring_Drain(Uring *r) {
+  if (r->writeFailed)
+    r->fill = -1; // Part of a file that is being given up on
+  else
+    SubmitFill(r);
+  while (r->writesInFlight > 0) {
+    if (Reap(r) > 0)
+      continue;
+    if (Enter(r, true) < 0 && errno != EINTR) {
+      r->writeFailed = true;
+      break;
+    }
+  }
+  bool ok = !r->writeFailed;
+  r->writeFailed = false;
+  return ok;
+}
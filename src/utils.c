@@ -30,9 +30,12 @@ void AddMessage(AppState *state, const char *sender, const char *content,
   msg->isSent = isSent;
   msg->hasHiddenMessage = false;
   msg->hiddenMessage[0] = '\0';
+  msg->contentHash[0] = '\0';
 
+  // localtime_r skips the per-call tzset (and its allocations) of localtime
   time_t now = time(NULL);
-  struct tm *tm_info = localtime(&now);
+  struct tm tm_buf;
+  struct tm *tm_info = localtime_r(&now, &tm_buf);
   if (tm_info) {
     strftime(msg->timestamp, sizeof(msg->timestamp), "%H:%M", tm_info);
   } else {